@@ -0,0 +1,48 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ADVERTISING_EVENT_TYPE_H_
+#define ADVERTISING_EVENT_TYPE_H_
+
+#include <stdint.h>
+#include "ble/BLE.h"
+
+/*
+ * Serialized form of ble::advertising_event_t, shared by everything storing advertising reports
+ * (GapEventRecorder, AdvertisingReportSink) so they agree on it. The bits follow the Event_Type
+ * of the HCI LE Extended Advertising Report, the layout advertising_event_t is built from:
+ * connectable (0x01), scannable (0x02), directed (0x04), scan response (0x08), legacy (0x10)
+ * and the data status in bits 5 and 6.
+ */
+
+/** Bits of the advertising event type, built from its predicates. */
+inline uint8_t advertising_event_to_bits(const ble::advertising_event_t &type)
+{
+    return (type.connectable() ? 0x01 : 0) |
+           (type.scannable_advertising() ? 0x02 : 0) |
+           (type.directed_advertising() ? 0x04 : 0) |
+           (type.scan_response() ? 0x08 : 0) |
+           (type.legacy_advertising() ? 0x10 : 0) |
+           ((type.data_status().value() & 0x03) << 5);
+}
+
+/** Advertising event type from bits written by advertising_event_to_bits(). */
+inline ble::advertising_event_t advertising_event_from_bits(uint8_t bits)
+{
+    return ble::advertising_event_t(bits);
+}
+
+#endif /* ADVERTISING_EVENT_TYPE_H_ */
@@ -0,0 +1,237 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ADVERTISING_PAYLOADS_H_
+#define ADVERTISING_PAYLOADS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "ble/BLE.h"
+#include "gap/AdvertisingDataBuilder.h"
+#include "gap/AdvertisingDataParser.h"
+#include "platform/NonCopyable.h"
+
+/** Which PDU an AD field is carried in. */
+enum class ad_payload_t {
+    ADVERTISING,
+    SCAN_RESPONSE
+};
+
+/**
+ * Cached advertising and scan response payloads of one advertising set.
+ *
+ * Flags are always in the advertising payload. Every other field, including the name, can be
+ * placed in either payload. Moving the name to the scan response leaves room in the advertising
+ * PDU for data that passive scanners should see. Scanners only get the scan response if they
+ * scan actively.
+ *
+ * Fields are patched in place. A payload is only marked as modified if its bytes actually
+ * changed, so apply_changes() can skip pushing identical data to the controller.
+ *
+ * BufferSize bounds each payload. Use ble::LEGACY_ADVERTISING_MAX_SIZE for a legacy advertising
+ * set so fields that wouldn't fit in the PDU are refused by set_field().
+ */
+template<size_t BufferSize>
+class AdvertisingPayloads : private mbed::NonCopyable<AdvertisingPayloads<BufferSize> >
+{
+public:
+    AdvertisingPayloads() :
+        _adv_builder(_adv_buffer),
+        _scan_rsp_builder(_scan_rsp_buffer)
+    {
+        clear();
+    }
+
+    /** Remove all fields from both payloads, only the flags are left. */
+    void clear()
+    {
+        _adv_builder.clear();
+        _scan_rsp_builder.clear();
+        _adv_builder.setFlags();
+        _adv_modified = true;
+        _scan_rsp_modified = true;
+    }
+
+    /**
+     * Builder of the given payload, can be used to set fields directly.
+     * The payload is considered modified.
+     */
+    ble::AdvertisingDataBuilder& builder(ad_payload_t payload)
+    {
+        modified(payload) = true;
+        return get_builder(payload);
+    }
+
+    /** Select the payload carrying the name. The name will be moved on the next set_name(). */
+    void set_name_placement(ad_payload_t payload)
+    {
+        _name_placement = payload;
+    }
+
+    /** Payload carrying the name. */
+    ad_payload_t get_name_placement() const
+    {
+        return _name_placement;
+    }
+
+    /** Set the complete local name in the payload selected with set_name_placement(). */
+    ble_error_t set_name(const char *name)
+    {
+        return set_field(_name_placement, ble::adv_data_type_t::COMPLETE_LOCAL_NAME, mbed::make_const_Span(
+            reinterpret_cast<const uint8_t*>(name), strlen(name)
+        ));
+    }
+
+    /**
+     * Add or replace a field in the given payload. The field is removed from the other payload.
+     *
+     * @returns BLE_ERROR_BUFFER_OVERFLOW if the field doesn't fit, the payload is left unchanged.
+     */
+    ble_error_t set_field(ad_payload_t payload, ble::adv_data_type_t type, mbed::Span<const uint8_t> value)
+    {
+        if (type == ble::adv_data_type_t::FLAGS && payload != ad_payload_t::ADVERTISING) {
+            return BLE_ERROR_INVALID_PARAM;
+        }
+
+        mbed::Span<const uint8_t> current;
+        if (find_field(get_payload(payload), type, current) &&
+            current.size() == value.size() &&
+            memcmp(current.data(), value.data(), value.size()) == 0) {
+            /* same bytes already in place */
+            return BLE_ERROR_NONE;
+        }
+
+        ble_error_t error = get_builder(payload).addOrReplaceData(type, value);
+
+        if (error) {
+            return error;
+        }
+        modified(payload) = true;
+
+        if (get_builder(other(payload)).removeData(type) == BLE_ERROR_NONE) {
+            modified(other(payload)) = true;
+        }
+
+        return BLE_ERROR_NONE;
+    }
+
+    /** Remove a field from whichever payload carries it. */
+    void remove_field(ble::adv_data_type_t type)
+    {
+        if (type != ble::adv_data_type_t::FLAGS && _adv_builder.removeData(type) == BLE_ERROR_NONE) {
+            _adv_modified = true;
+        }
+        if (_scan_rsp_builder.removeData(type) == BLE_ERROR_NONE) {
+            _scan_rsp_modified = true;
+        }
+    }
+
+    /** Current content of the given payload. */
+    mbed::Span<const uint8_t> get_payload(ad_payload_t payload)
+    {
+        return get_builder(payload).getAdvertisingData();
+    }
+
+    /** True if a payload has changed since it was last pushed to the controller. */
+    bool is_modified() const
+    {
+        return _adv_modified || _scan_rsp_modified;
+    }
+
+    /** Push both payloads to the advertising set. */
+    ble_error_t apply(ble::Gap &gap, ble::advertising_handle_t handle)
+    {
+        _adv_modified = true;
+        _scan_rsp_modified = true;
+        return apply_changes(gap, handle);
+    }
+
+    /**
+     * Push only the payloads that changed since the last push. This can be done while the set
+     * is advertising.
+     */
+    ble_error_t apply_changes(ble::Gap &gap, ble::advertising_handle_t handle)
+    {
+        ble_error_t error;
+
+        if (_adv_modified) {
+            error = gap.setAdvertisingPayload(handle, _adv_builder.getAdvertisingData());
+            if (error) {
+                return error;
+            }
+            _adv_modified = false;
+        }
+
+        if (_scan_rsp_modified) {
+            /* an empty scan response clears any previous one */
+            error = gap.setAdvertisingScanResponse(handle, _scan_rsp_builder.getAdvertisingData());
+            if (error) {
+                return error;
+            }
+            _scan_rsp_modified = false;
+        }
+
+        return BLE_ERROR_NONE;
+    }
+
+private:
+    static ad_payload_t other(ad_payload_t payload)
+    {
+        return payload == ad_payload_t::ADVERTISING ? ad_payload_t::SCAN_RESPONSE : ad_payload_t::ADVERTISING;
+    }
+
+    ble::AdvertisingDataBuilder& get_builder(ad_payload_t payload)
+    {
+        return payload == ad_payload_t::ADVERTISING ? _adv_builder : _scan_rsp_builder;
+    }
+
+    bool& modified(ad_payload_t payload)
+    {
+        return payload == ad_payload_t::ADVERTISING ? _adv_modified : _scan_rsp_modified;
+    }
+
+    static bool find_field(
+        mbed::Span<const uint8_t> payload,
+        ble::adv_data_type_t type,
+        mbed::Span<const uint8_t> &value
+    )
+    {
+        ble::AdvertisingDataParser parser(payload);
+
+        while (parser.hasNext()) {
+            ble::AdvertisingDataParser::element_t field = parser.next();
+            if (field.type == type) {
+                value = field.value;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    uint8_t _adv_buffer[BufferSize];
+    uint8_t _scan_rsp_buffer[BufferSize];
+    ble::AdvertisingDataBuilder _adv_builder;
+    ble::AdvertisingDataBuilder _scan_rsp_builder;
+
+    ad_payload_t _name_placement = ad_payload_t::ADVERTISING;
+    bool _adv_modified = true;
+    bool _scan_rsp_modified = true;
+};
+
+#endif /* ADVERTISING_PAYLOADS_H_ */
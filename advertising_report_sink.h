@@ -0,0 +1,332 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ADVERTISING_REPORT_SINK_H_
+#define ADVERTISING_REPORT_SINK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "advertising_event_type.h"
+#include "gap_event_dispatcher.h"
+#include "ble/BLE.h"
+#include "events/mbed_events.h"
+#include "platform/Callback.h"
+#include "platform/NonCopyable.h"
+#include "platform/Span.h"
+#include "platform/mbed_assert.h"
+#include "platform/mbed_atomic.h"
+
+/** Advertising report stored in the ring of an AdvertisingReportSink. */
+struct advertising_report_t {
+    /** EventQueue::tick() of the BLE event queue when the report was received. */
+    uint32_t tick = 0;
+    ble::peer_address_type_t address_type = ble::peer_address_type_t::PUBLIC;
+    ble::address_t address;
+    ble::advertising_event_t type = ble::advertising_event_t(0);
+    ble::rssi_t rssi = 0;
+    ble::phy_t primary_phy = ble::phy_t::NONE;
+    ble::phy_t secondary_phy = ble::phy_t::NONE;
+    /** Points into the ring, only valid while the batch is being handled. */
+    mbed::Span<const uint8_t> payload;
+};
+
+/** Reports delivered together, read in place from the ring. */
+class AdvertisingReportBatch
+{
+public:
+    AdvertisingReportBatch(const uint8_t *buffer, size_t size, uint32_t begin, uint32_t end, uint32_t dropped) :
+        _buffer(buffer), _size(size), _position(begin), _end(end), _dropped(dropped)
+    {
+    }
+
+    /** Read the next report, returns false at the end of the batch. */
+    bool next(advertising_report_t &report)
+    {
+        while (_position != _end) {
+            const uint8_t *record = _buffer + (_position % _size);
+            uint16_t record_size;
+            memcpy(&record_size, record, sizeof(record_size));
+
+            if (!record_size) {
+                /* padding up to the end of the ring, the record is at the start */
+                _position += _size - (_position % _size);
+                continue;
+            }
+
+            record_header_t header;
+            memcpy(&header, record, sizeof(header));
+
+            report.tick = header.tick;
+            report.address_type = (ble::peer_address_type_t::type)header.address_type;
+            report.address = ble::address_t(header.address);
+            report.type = advertising_event_from_bits(header.event_type);
+            report.rssi = header.rssi;
+            report.primary_phy = (ble::phy_t::type)header.primary_phy;
+            report.secondary_phy = (ble::phy_t::type)header.secondary_phy;
+            report.payload = mbed::make_const_Span(record + sizeof(header), header.payload_length);
+
+            _position += record_size;
+            return true;
+        }
+        return false;
+    }
+
+    /** Reports dropped because the ring was full since the previous batch. */
+    uint32_t get_dropped() const
+    {
+        return _dropped;
+    }
+
+private:
+    friend class AdvertisingReportSink;
+
+    /** Layout of a record in the ring, followed by the payload and padding to 4 bytes. */
+    struct record_header_t {
+        /* size of the record, 0 marks the padding before wrapping to the start */
+        uint16_t size;
+        uint16_t payload_length;
+        uint32_t tick;
+        uint8_t address[6];
+        uint8_t address_type;
+        int8_t rssi;
+        uint8_t primary_phy;
+        uint8_t secondary_phy;
+        /* advertising_event_to_bits() */
+        uint8_t event_type;
+    };
+
+    const uint8_t *_buffer;
+    size_t _size;
+    uint32_t _position;
+    uint32_t _end;
+    uint32_t _dropped;
+};
+
+/**
+ * Opt-in sink copying advertising reports into a preallocated ring and delivering them in
+ * batches to a consumer on its own event queue.
+ *
+ * Set it with BLEApp::set_report_sink(), or attach it with add_gap_event_handler(&sink,
+ * AdvertisingReportSink::EVENT_MASK) to scan yourself. Each report is copied once into the ring
+ * as a contiguous record. The consumer gets a batch when batch_size reports are waiting or
+ * max_latency after the first report of the batch, whichever comes first, and reads the reports
+ * in place. Their space is released when the handler returns.
+ *
+ * When the ring is full, reports are dropped and counted; the next batch tells how many were
+ * dropped before it. The ring is shared by one producer (the BLE event queue) and one consumer
+ * (the consumer queue) without locks.
+ */
+class AdvertisingReportSink : private mbed::NonCopyable<AdvertisingReportSink>, public ble::Gap::EventHandler
+{
+public:
+    static const uint32_t EVENT_MASK = GAP_EVENT_ADVERTISING_REPORT;
+
+    typedef mbed::Callback<void(AdvertisingReportBatch &batch)> batch_handler_t;
+
+    struct stats_t {
+        uint32_t received = 0;
+        uint32_t dropped = 0;
+        uint32_t batches = 0;
+        uint32_t largest_batch = 0;
+        /** Most bytes of the ring in use. */
+        uint32_t high_water = 0;
+    };
+
+    /**
+     * @param buffer Memory of the ring, it must outlive the sink. Its size in words must be a
+     * power of two so positions stay valid when the byte counters wrap.
+     * @param consumer_queue Queue the batch handler is called from.
+     * @param handler Called with each batch.
+     * @param ble_queue Queue dispatching the BLE events, used to timestamp reports.
+     */
+    AdvertisingReportSink(
+        mbed::Span<uint32_t> buffer,
+        events::EventQueue &consumer_queue,
+        batch_handler_t handler,
+        events::EventQueue &ble_queue
+    ) :
+        _buffer(reinterpret_cast<uint8_t*>(buffer.data())),
+        _size(buffer.size() * sizeof(uint32_t)),
+        _consumer_queue(consumer_queue),
+        _ble_queue(ble_queue),
+        _handler(handler)
+    {
+        MBED_ASSERT(_size && (_size & (_size - 1)) == 0);
+    }
+
+    /**
+     * Set when batches are delivered.
+     *
+     * @param batch_size Deliver as soon as this many reports are waiting.
+     * @param max_latency Deliver at the latest this long after the first report of the batch.
+     */
+    void set_batching(uint32_t batch_size, ble::millisecond_t max_latency)
+    {
+        _batch_size = batch_size ? batch_size : 1;
+        _max_latency_ms = max_latency.value();
+    }
+
+    /** Statistics, updated concurrently by both queues. */
+    stats_t get_stats() const
+    {
+        return _stats;
+    }
+
+    void print_stats() const
+    {
+        printf("Reports received %lu, dropped %lu, batches %lu, largest batch %lu, ring high water %lu/%lu bytes\r\n",
+               (unsigned long)_stats.received, (unsigned long)_stats.dropped,
+               (unsigned long)_stats.batches, (unsigned long)_stats.largest_batch,
+               (unsigned long)_stats.high_water, (unsigned long)_size);
+    }
+
+    /** Copy the report in the ring. Runs on the BLE event queue. */
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override
+    {
+        _stats.received++;
+
+        const mbed::Span<const uint8_t> &payload = event.getPayload();
+        const uint32_t record_size = align(sizeof(AdvertisingReportBatch::record_header_t) + payload.size());
+        const uint32_t read = core_util_atomic_load_u32(&_read);
+        uint32_t write = _write;
+
+        const uint32_t used = write - read;
+        const uint32_t contiguous = _size - (write % _size);
+        /* records don't wrap, the end of the ring is skipped if too short */
+        const uint32_t padding = record_size > contiguous ? contiguous : 0;
+
+        if (used + padding + record_size > _size) {
+            core_util_atomic_incr_u32(&_dropped, 1);
+            _stats.dropped++;
+            return;
+        }
+
+        if (padding) {
+            memset(_buffer + (write % _size), 0, sizeof(uint16_t));
+            write += padding;
+        }
+
+        AdvertisingReportBatch::record_header_t header;
+        header.size = record_size;
+        header.payload_length = payload.size();
+        header.tick = _ble_queue.tick();
+        memcpy(header.address, event.getPeerAddress().data(), sizeof(header.address));
+        header.address_type = event.getPeerAddressType().value();
+        header.rssi = event.getRssi();
+        header.primary_phy = event.getPrimaryPhy().value();
+        header.secondary_phy = event.getSecondaryPhy().value();
+        header.event_type = advertising_event_to_bits(event.getType());
+
+        uint8_t *record = _buffer + (write % _size);
+        memcpy(record, &header, sizeof(header));
+        memcpy(record + sizeof(header), payload.data(), payload.size());
+        write += record_size;
+
+        /* publish the record to the consumer */
+        core_util_atomic_store_u32(&_write, write);
+
+        if (used + padding + record_size > _stats.high_water) {
+            _stats.high_water = used + padding + record_size;
+        }
+
+        schedule_delivery(core_util_atomic_incr_u32(&_waiting, 1));
+    }
+
+private:
+    static uint32_t align(uint32_t size)
+    {
+        return (size + 3) & ~3u;
+    }
+
+    /** Make sure a delivery is on its way to the consumer queue. */
+    void schedule_delivery(uint32_t waiting)
+    {
+        if (waiting >= _batch_size) {
+            if (!core_util_atomic_exchange_bool(&_flush_posted, true)) {
+                if (!_consumer_queue.call([this]() { deliver(); })) {
+                    core_util_atomic_store_bool(&_flush_posted, false);
+                }
+            }
+        } else if (!core_util_atomic_exchange_bool(&_timer_posted, true)) {
+            /* bound the latency of the first reports of the batch */
+            if (!_consumer_queue.call_in(std::chrono::milliseconds(_max_latency_ms), [this]() {
+                core_util_atomic_store_bool(&_timer_posted, false);
+                deliver();
+            })) {
+                core_util_atomic_store_bool(&_timer_posted, false);
+            }
+        }
+    }
+
+    /** Hand the waiting reports to the consumer then release them. Runs on the consumer queue. */
+    void deliver()
+    {
+        core_util_atomic_store_bool(&_flush_posted, false);
+
+        const uint32_t end = core_util_atomic_load_u32(&_write);
+        const uint32_t begin = _read;
+
+        if (begin == end) {
+            return;
+        }
+
+        /* only reports published before end are in the batch */
+        uint32_t count = 0;
+        AdvertisingReportBatch counter(_buffer, _size, begin, end, 0);
+        advertising_report_t report;
+        while (counter.next(report)) {
+            count++;
+        }
+        core_util_atomic_decr_u32(&_waiting, count);
+
+        AdvertisingReportBatch batch(_buffer, _size, begin, end, core_util_atomic_exchange_u32(&_dropped, 0));
+        if (_handler) {
+            _handler(batch);
+        }
+
+        _stats.batches++;
+        if (count > _stats.largest_batch) {
+            _stats.largest_batch = count;
+        }
+
+        /* the records can be overwritten from now */
+        core_util_atomic_store_u32(&_read, end);
+    }
+
+private:
+    uint8_t *_buffer;
+    const uint32_t _size;
+    events::EventQueue &_consumer_queue;
+    events::EventQueue &_ble_queue;
+    batch_handler_t _handler;
+
+    uint32_t _batch_size = 16;
+    uint32_t _max_latency_ms = 100;
+
+    /* free running byte counters, the position in the ring is modulo its size */
+    uint32_t _write = 0;
+    uint32_t _read = 0;
+    uint32_t _waiting = 0;
+    uint32_t _dropped = 0;
+    bool _flush_posted = false;
+    bool _timer_posted = false;
+
+    stats_t _stats;
+};
+
+#endif /* ADVERTISING_REPORT_SINK_H_ */
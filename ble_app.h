@@ -18,38 +18,108 @@
 #define BLE_APP_H_
 
 #include "pretty_printer.h"
+#include "scan_scheduler.h"
+#include "connection_attempts.h"
+#include "advertising_report_sink.h"
+#include "advertising_payloads.h"
 #include "ble/BLE.h"
-#include "ChainableGapEventHandler.h"
+#include "gap_event_dispatcher.h"
 #include "events/mbed_events.h"
 #include "platform/Callback.h"
 #include "platform/NonCopyable.h"
+#include "platform/mbed_atomic.h"
 
 static const uint16_t MAX_ADVERTISING_PAYLOAD_SIZE = 50;
+static const uint16_t MAX_PERIODIC_ADVERTISING_PAYLOAD_SIZE = 100;
+/* capacity of the sync table, set_max_periodic_syncs() picks how many are used */
+static const size_t MAX_PERIODIC_SYNCS = 8;
 
 /**
  * This is a simplified app that handles running a BLE process for you. This will initialise the instance
  * and handle the event queue.
  *
- * Use add_gap_event_handler() to get notified of gap events like connections.
+ * Use add_gap_event_handler() to get notified of gap events like connections. Pass a mask of the
+ * events your handler implements so frequent events like advertising reports only reach handlers
+ * that need them.
+ * Add a LinkTelemetry handler to collect RSSI, PHY and connection parameters of the connections.
  * Use set_advertising_name to enable advertising under the given name. Use nullptr to disable advertising.
  * Use set_target_name to enable scanning and attempt to connect to a device with the given name.
  * Use nullptr to stop the scan.
+ * Use get_scan_scheduler() to change the scan profiles used while looking for the target.
+ * Use set_report_sink() to receive raw advertising reports in batches on another queue.
+ * Use get_counters() to read how often each BLE call failed, with which error, and how many
+ * times advertising and scanning started, connections were made, failed and closed.
+ * Use set_identity_resolver() to resolve the private addresses of peers, e.g. with an RpaResolver,
+ * so the peer we were connected to is found again after its address changed.
+ * Use get_connection_attempts() to change the connection timeout and the backoff applied to
+ * peers that failed to connect.
+ * Use set_advertising_field() to add data to the advertising or scan response payload and
+ * set_name_placement() to choose which one carries the name.
+ * Use update_advertising_data() to change advertised data without restarting advertising.
+ * Use start_periodic_advertising() to broadcast data in a periodic advertising train.
+ * Use set_periodic_report_handler() to scan for periodic advertising trains, sync to them and
+ * receive their data without connecting. Use set_periodic_sync_filter() to pick the trains and
+ * set_max_periodic_syncs() to choose how many are followed.
  *
  * Use the start() method to start your application. This call will block and continue execution in the given
  * callback.
  * Use the stop() method to end the BLE process. This will stop servicing the event queue and shutdown
  * the BLE instance. This will cause the start() method that started it to return.
+ * Use stop(false) to keep the BLE instance initialized, the next start() then skips BLE::init.
+ * Use restart() to reconfigure a running app without going through BLE::init again.
+ * Use set_advertise_before_post_init() to start advertising before running the callback and
+ * get_startup_stats() to measure the time from start to the first advertisement.
  *
  */
 class BLEApp : private mbed::NonCopyable<BLEApp>, public ble::Gap::EventHandler
 {
 public:
+    /** Usage of the event queue by the app. */
+    struct event_queue_stats_t {
+        /** Events posted, including failed posts. */
+        uint32_t posts = 0;
+        /** Posts that failed because the queue ran out of event memory. */
+        uint32_t failed_posts = 0;
+        /** Events posted and not run yet. */
+        uint32_t depth = 0;
+        /** Highest depth seen. */
+        uint32_t high_water = 0;
+    };
+
+    /** Startup times of the app in milliseconds, measured from start() or restart(). */
+    struct startup_stats_t {
+        /** The BLE instance was already initialized, BLE::init was skipped. */
+        bool warm = false;
+        /** Time until BLE was initialized. */
+        uint32_t init_ms = 0;
+        /** An advertisement has been started since start() or restart(). */
+        bool advertised = false;
+        /** Time until the first advertisement started. */
+        uint32_t first_advertising_ms = 0;
+    };
+
+    /**
+     * Resolve the address of a peer to its identity address at the given EventQueue::tick(),
+     * returns false if it doesn't resolve. See RpaResolver::resolve_identity().
+     */
+    typedef mbed::Callback<bool(
+        ble::peer_address_type_t address_type,
+        const ble::address_t &address,
+        uint32_t now,
+        ble::address_t &identity
+    )> identity_resolver_t;
+
+    /** Decide from its advertising report whether to sync to a periodic train. */
+    typedef mbed::Callback<bool(const ble::AdvertisingReportEvent &event)> periodic_sync_filter_t;
+
     /**
      * Construct a BLEApp from a BLE instance.
      * Call start() to initiate ble processing.
      */
     BLEApp() : _ble(BLE::Instance())
     {
+        /* a train may only be heard after a few of its periodic intervals */
+        _sync_attempts.set_timeout(ble::millisecond_t(10000));
     }
 
     ~BLEApp()
@@ -67,14 +137,20 @@ public:
         printf("Ble App started\r\n");
 
         _post_init_cb = post_init_cb;
+        _start_tick = _event_queue.tick();
+        _startup_stats = startup_stats_t();
+
+        /* the instance may have been shut down by someone else since stop(false) */
+        const bool warm = _ble_kept_initialized && _ble.hasInitialized();
+        _ble_kept_initialized = false;
 
-        if (_ble.hasInitialized()) {
+        if (_ble.hasInitialized() && !warm) {
             printf("Error: the ble instance has already been initialized.\r\n");
             return;
         }
 
         /* Register the BLEApp as the handler for gap events */
-        _gap_handler.addEventHandler(this);
+        _gap_handler.add_event_handler(this);
         _ble.gap().setEventHandler(&_gap_handler);
 
         /* This will inform us of all events so we can schedule their handling
@@ -83,13 +159,19 @@ public:
             makeFunctionPointer(this, &BLEApp::schedule_ble_events)
         );
 
-        ble_error_t error = _ble.init(
-            this, &BLEApp::on_init_complete
-        );
+        if (warm) {
+            /* left initialized by stop(false), no need to go through init again */
+            _startup_stats.warm = true;
+            post([this]() { on_ready(); });
+        } else {
+            ble_error_t error = _counters.check(BLE_CALL_INIT, _ble.init(
+                this, &BLEApp::on_init_complete
+            ));
 
-        if (error) {
-            print_error(error, "Error returned by BLE::init.\r\n");
-            return;
+            if (error) {
+                print_error(error, "Error returned by BLE::init.\r\n");
+                return;
+            }
         }
 
         /* Process the event queue. */
@@ -102,34 +184,90 @@ public:
 
     /**
      * Close advertising and/or existing connections and stop the App.
+     *
+     * @param shutdown_ble Shutdown the BLE instance. If false, activity is stopped but the
+     * instance stays initialized and the next start() skips BLE::init.
      */
-    void stop()
+    void stop(bool shutdown_ble = true)
     {
         /* let any left over events run */
-        _event_queue.call([this]() {
+        post([this, shutdown_ble]() {
             if (_ble.hasInitialized()) {
-                _ble.shutdown();
-                printf("Ble App stopped.\r\n");
+                if (shutdown_ble) {
+                    _ble.shutdown();
+                    printf("Ble App stopped.\r\n");
+                } else {
+                    stop_activity();
+                    printf("Ble App stopped, ble instance kept initialized.\r\n");
+                }
             }
+            _ble_kept_initialized = !shutdown_ble && _ble.hasInitialized();
             _event_queue.break_dispatch();
 
-            _connected = false;
-            _is_connecting = false;
-            _is_scanning = false;
-            _gap_handler = ChainableGapEventHandler();
+            reset_activity_state();
+            _gap_handler.clear();
+            _report_sink = nullptr;
+            _scan_scheduler.release();
         });
     }
 
+    /**
+     * Stop all activity and close connections, then run the post init callback and start
+     * again as after start(), without shutting down the BLE instance. Use it to reconfigure
+     * a running app without paying for BLE::init. Event handlers stay registered.
+     *
+     * @param post_init_cb Callback replacing the one given to start(), if any.
+     */
+    void restart(mbed::Callback<void(BLE&, events::EventQueue&)> post_init_cb = nullptr)
+    {
+        post([this, post_init_cb]() {
+            if (!_ble.hasInitialized()) {
+                printf("Error: the ble instance is not initialized.\r\n");
+                return;
+            }
+
+            stop_activity();
+            reset_activity_state();
+
+            if (post_init_cb) {
+                _post_init_cb = post_init_cb;
+            }
+            _start_tick = _event_queue.tick();
+            _startup_stats = startup_stats_t();
+            _startup_stats.warm = true;
+
+            printf("Ble App restarted\r\n");
+            on_ready();
+        });
+    }
+
+    /**
+     * Start advertising as soon as BLE is initialized and run the post init callback after, so
+     * a slow callback doesn't delay the first advertisement. Advertising starts with the
+     * name and data set before start(); the callback can still change them.
+     */
+    void set_advertise_before_post_init(bool advertise_first)
+    {
+        _advertise_before_post_init = advertise_first;
+    }
+
+    /** Startup times since the last start() or restart(). */
+    startup_stats_t get_startup_stats() const
+    {
+        return _startup_stats;
+    }
+
     /**
      * Subscribe with your own gap handler.
      *
      * @param[in] gap_handler Handler implementing selected ble::Gap::EventHandler methods.
+     * @param[in] mask Events the handler subscribes to, a combination of gap_event_mask_t values.
      *
      * @returns True on success.
      */
-    bool add_gap_event_handler(ble::Gap::EventHandler *gap_handler)
+    bool add_gap_event_handler(ble::Gap::EventHandler *gap_handler, uint32_t mask = GAP_EVENT_ALL)
     {
-        return _gap_handler.addEventHandler(gap_handler);
+        return _gap_handler.add_event_handler(gap_handler, mask);
     }
 
     /** Set name we advertise as. */
@@ -146,10 +284,10 @@ public:
             memcpy(new_name, advertising_name, length);
         }
 
-        _event_queue.call([this,new_name]() {
+        post([this,new_name]() {
             delete _advertising_name;
             _advertising_name = new_name;
-            _event_queue.call([this]() { start_activity(); });
+            post([this]() { start_activity(); });
         });
 
         return true;
@@ -169,10 +307,14 @@ public:
             memcpy(new_name, target_name, length);
         }
 
-        _event_queue.call([this,new_name]() {
+        post([this,new_name]() {
             delete _target_name;
             _target_name = new_name;
-            _event_queue.call([this]() { start_activity(); });
+            /* the identity we reconnect to belongs to the previous target */
+            _has_reconnect_identity = false;
+            _scan_scheduler.expect_target();
+            _scan_resume_tick = _event_queue.tick();
+            post([this]() { start_activity(); });
         });
 
         return true;
@@ -190,6 +332,419 @@ public:
         return _target_name;
     }
 
+    /**
+     * Add or replace an AD field in the advertising or scan response payload. It will be sent
+     * the next time advertising starts. Only use it from the event queue.
+     *
+     * @returns BLE_ERROR_BUFFER_OVERFLOW if the field doesn't fit in the payload.
+     */
+    ble_error_t set_advertising_field(
+        ad_payload_t payload,
+        ble::adv_data_type_t type,
+        mbed::Span<const uint8_t> value
+    )
+    {
+        return _adv_payloads.set_field(payload, type, value);
+    }
+
+    /** Remove an AD field from the payloads. Only use it from the event queue. */
+    void remove_advertising_field(ble::adv_data_type_t type)
+    {
+        _adv_payloads.remove_field(type);
+    }
+
+    /**
+     * Patch an AD field in the payloads while advertising. Nothing is sent to the controller if
+     * the bytes are identical. Changes are sent at most once per update interval, the last value
+     * wins. Advertising is not stopped. Only use it from the event queue.
+     *
+     * @returns BLE_ERROR_BUFFER_OVERFLOW if the field doesn't fit in the payload.
+     */
+    ble_error_t update_advertising_data(
+        ad_payload_t payload,
+        ble::adv_data_type_t type,
+        mbed::Span<const uint8_t> value
+    )
+    {
+        ble_error_t error = _adv_payloads.set_field(payload, type, value);
+
+        if (error) {
+            return error;
+        }
+
+        if (_adv_payloads.is_modified()) {
+            schedule_advertising_data_update();
+        }
+
+        return BLE_ERROR_NONE;
+    }
+
+    /** Set the minimum time between two payload updates sent by update_advertising_data(). */
+    void set_advertising_update_interval(ble::millisecond_t interval)
+    {
+        _adv_update_interval = interval;
+    }
+
+    /**
+     * Choose the payload carrying the advertising name. Placing it in the scan response leaves
+     * room for data in the advertising payload. Only use it from the event queue.
+     */
+    void set_name_placement(ad_payload_t payload)
+    {
+        _adv_payloads.set_name_placement(payload);
+    }
+
+    /**
+     * Start periodic advertising of the payload in an extended advertising set. The advertising
+     * name, if set, is carried by the extended advertising that points to the periodic train.
+     * Only use it from the event queue.
+     *
+     * @param payload AD data sent in every periodic advertising event.
+     * @param interval Interval of the periodic advertising train.
+     *
+     * @returns BLE_ERROR_NOT_IMPLEMENTED if the controller doesn't support periodic advertising.
+     */
+    ble_error_t start_periodic_advertising(
+        mbed::Span<const uint8_t> payload,
+        ble::periodic_interval_t interval
+    )
+    {
+        if (!_ble.hasInitialized()) {
+            return BLE_ERROR_INITIALIZATION_INCOMPLETE;
+        }
+
+        ble::Gap &gap = _ble.gap();
+
+        if (!gap.isFeatureSupported(ble::controller_supported_features_t::LE_EXTENDED_ADVERTISING) ||
+            !gap.isFeatureSupported(ble::controller_supported_features_t::LE_PERIODIC_ADVERTISING)) {
+            return BLE_ERROR_NOT_IMPLEMENTED;
+        }
+
+        ble_error_t error;
+
+        if (_periodic_adv_handle == ble::INVALID_ADVERTISING_HANDLE) {
+            ble::AdvertisingParameters adv_params(
+                ble::advertising_type_t::NON_CONNECTABLE_UNDIRECTED,
+                ble::adv_interval_t(ble::millisecond_t(200))
+            );
+            adv_params.setUseLegacyPDU(false);
+
+            error = _counters.check(
+                BLE_CALL_PERIODIC_CREATE_ADVERTISING_SET,
+                gap.createAdvertisingSet(&_periodic_adv_handle, adv_params)
+            );
+
+            if (error) {
+                print_error(error, "Gap::createAdvertisingSet() failed\r\n");
+                return error;
+            }
+
+            uint8_t adv_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
+            ble::AdvertisingDataBuilder adv_data_builder(adv_buffer);
+            error = BLE_ERROR_NONE;
+
+            if (_advertising_name) {
+                error = adv_data_builder.setName(_advertising_name);
+
+                if (error) {
+                    print_error(error, "AdvertisingDataBuilder::setName() failed (name too long?)\r\n");
+                }
+            }
+
+            if (!error) {
+                error = _counters.check(
+                    BLE_CALL_PERIODIC_SET_ADVERTISING_PAYLOAD,
+                    gap.setAdvertisingPayload(_periodic_adv_handle, adv_data_builder.getAdvertisingData())
+                );
+
+                if (error) {
+                    print_error(error, "Gap::setAdvertisingPayload() failed\r\n");
+                }
+            }
+
+            if (error) {
+                /* don't keep a half configured set, the next call starts over */
+                gap.destroyAdvertisingSet(_periodic_adv_handle);
+                _periodic_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+                return error;
+            }
+        }
+
+        error = _counters.check(
+            BLE_CALL_SET_PERIODIC_ADVERTISING_PARAMETERS,
+            gap.setPeriodicAdvertisingParameters(_periodic_adv_handle, interval, interval)
+        );
+
+        if (error) {
+            print_error(error, "Gap::setPeriodicAdvertisingParameters() failed\r\n");
+            return error;
+        }
+
+        error = update_periodic_advertising_data(payload);
+
+        if (error) {
+            return error;
+        }
+
+        if (!gap.isAdvertisingActive(_periodic_adv_handle)) {
+            error = _counters.check(
+                BLE_CALL_PERIODIC_START_ADVERTISING,
+                gap.startAdvertising(_periodic_adv_handle)
+            );
+
+            if (error) {
+                print_error(error, "Gap::startAdvertising() failed\r\n");
+                return error;
+            }
+        }
+
+        if (!gap.isPeriodicAdvertisingActive(_periodic_adv_handle)) {
+            error = _counters.check(
+                BLE_CALL_START_PERIODIC_ADVERTISING,
+                gap.startPeriodicAdvertising(_periodic_adv_handle)
+            );
+
+            if (error) {
+                print_error(error, "Gap::startPeriodicAdvertising() failed\r\n");
+                return error;
+            }
+        }
+
+        printf("Periodic advertising started\r\n");
+
+        return BLE_ERROR_NONE;
+    }
+
+    /** Replace the periodic advertising payload. Only use it from the event queue. */
+    ble_error_t update_periodic_advertising_data(mbed::Span<const uint8_t> payload)
+    {
+        if (payload.size() > MAX_PERIODIC_ADVERTISING_PAYLOAD_SIZE) {
+            return BLE_ERROR_BUFFER_OVERFLOW;
+        }
+
+        if (_periodic_adv_handle == ble::INVALID_ADVERTISING_HANDLE) {
+            return BLE_ERROR_INVALID_STATE;
+        }
+
+        ble_error_t error = _counters.check(
+            BLE_CALL_SET_PERIODIC_ADVERTISING_PAYLOAD,
+            _ble.gap().setPeriodicAdvertisingPayload(_periodic_adv_handle, payload)
+        );
+
+        if (error) {
+            print_error(error, "Gap::setPeriodicAdvertisingPayload() failed\r\n");
+        }
+
+        return error;
+    }
+
+    /** Stop periodic advertising and release its advertising set. Only use it from the event queue. */
+    void stop_periodic_advertising()
+    {
+        if (_periodic_adv_handle == ble::INVALID_ADVERTISING_HANDLE) {
+            return;
+        }
+
+        ble::Gap &gap = _ble.gap();
+
+        if (gap.isPeriodicAdvertisingActive(_periodic_adv_handle)) {
+            gap.stopPeriodicAdvertising(_periodic_adv_handle);
+        }
+        if (gap.isAdvertisingActive(_periodic_adv_handle)) {
+            gap.stopAdvertising(_periodic_adv_handle);
+        }
+        gap.destroyAdvertisingSet(_periodic_adv_handle);
+
+        _periodic_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+    }
+
+    /**
+     * Copy advertising reports to the sink, which delivers them in batches to its consumer.
+     * We keep scanning while a sink is set. Use nullptr to remove the sink.
+     *
+     * A sink has no target to find, so the scan scheduler is held at scan_level instead of
+     * backing off while the sink is set.
+     *
+     * @param scan_level Profile of the scan scheduler used while the sink is set.
+     */
+    void set_report_sink(AdvertisingReportSink *sink, size_t scan_level = 0)
+    {
+        post([this, sink, scan_level]() {
+            if (_report_sink) {
+                _gap_handler.remove_event_handler(_report_sink);
+            }
+
+            _report_sink = sink;
+
+            if (_report_sink && !_gap_handler.add_event_handler(_report_sink, AdvertisingReportSink::EVENT_MASK)) {
+                printf("Error: too many handlers, report sink not set.\r\n");
+                _report_sink = nullptr;
+            }
+
+            if (_report_sink) {
+                _scan_scheduler.hold(scan_level);
+                /* don't wait for the idle period of a backed off profile */
+                _scan_resume_tick = _event_queue.tick();
+            } else {
+                _scan_scheduler.release();
+                _scan_scheduler.expect_target();
+            }
+
+            start_activity();
+        });
+    }
+
+    /**
+     * Set the callback receiving periodic advertising reports. While set, we scan for extended
+     * advertising pointing to periodic trains and sync to up to set_max_periodic_syncs() of them.
+     * No connection is made. Use nullptr to stop syncing and terminate existing syncs.
+     *
+     * A sync that isn't established in time is cancelled and the advertiser is skipped for a
+     * backoff period, see get_periodic_sync_attempts().
+     */
+    void set_periodic_report_handler(
+        mbed::Callback<void(const ble::PeriodicAdvertisingReportEvent &event)> cb
+    )
+    {
+        post([this, cb]() {
+            _periodic_report_cb = cb;
+            if (!cb) {
+                terminate_periodic_syncs();
+            } else {
+                _scan_scheduler.expect_target();
+            }
+            post([this]() { start_activity(); });
+        });
+    }
+
+    /**
+     * Only sync to the trains whose advertising report passes the filter, e.g. by address, name
+     * or SID. Without a filter we sync to any train. Existing syncs are kept.
+     */
+    void set_periodic_sync_filter(periodic_sync_filter_t filter)
+    {
+        post([this, filter]() {
+            _periodic_sync_filter = filter;
+        });
+    }
+
+    /** Number of periodic trains followed at the same time, at most MAX_PERIODIC_SYNCS. */
+    void set_max_periodic_syncs(size_t max_syncs)
+    {
+        post([this, max_syncs]() {
+            _max_periodic_syncs = max_syncs > MAX_PERIODIC_SYNCS ? MAX_PERIODIC_SYNCS : max_syncs;
+            start_activity();
+        });
+    }
+
+    /**
+     * Access the timeout and backoff of periodic sync creation. Only use it from the event queue.
+     */
+    ConnectionAttempts& get_periodic_sync_attempts()
+    {
+        return _sync_attempts;
+    }
+
+    typedef mbed::Callback<ble_error_t(
+        ble::peer_address_type_t peer_address_type,
+        const ble::address_t &peer_address,
+        const ble::ConnectionParameters &connection_params
+    )> connect_hook_t;
+
+    /**
+     * Replace the call to Gap::connect() made when the target is found, e.g. to benchmark the
+     * scan path without connecting. The hook must report the outcome with a ConnectionCompleteEvent
+     * like the stack would. While it is set, the scan isn't stopped for the attempt and the
+     * attempts aren't logged, so only the handling of reports is measured. Use nullptr to connect
+     * for real. Only use it from the event queue.
+     */
+    void set_connect_hook(connect_hook_t hook)
+    {
+        _connect_hook = hook;
+    }
+
+    /** Event queue running the app. */
+    events::EventQueue& get_event_queue()
+    {
+        return _event_queue;
+    }
+
+    /** Usage of the event queue since start or the last reset. */
+    event_queue_stats_t get_event_queue_stats() const
+    {
+        return _queue_stats;
+    }
+
+    /** Reset the counters and high water mark, the current depth is kept. */
+    void reset_event_queue_stats()
+    {
+        _queue_stats.posts = 0;
+        _queue_stats.failed_posts = 0;
+        core_util_atomic_store_u32(&_queue_stats.high_water, core_util_atomic_load_u32(&_queue_stats.depth));
+    }
+
+    /**
+     * Access the scheduler picking scan parameters. Only use it from the event queue.
+     */
+    ScanScheduler& get_scan_scheduler()
+    {
+        return _scan_scheduler;
+    }
+
+    /**
+     * Access the timeout and backoff of connection attempts. Only use it from the event queue.
+     */
+    ConnectionAttempts& get_connection_attempts()
+    {
+        return _connect_attempts;
+    }
+
+    /**
+     * Counters of the results of BLE calls and of app events. Only use it from the event queue,
+     * e.g. post a call to snapshot() or serialize() to read them from another thread.
+     */
+    BleCounters& get_counters()
+    {
+        return _counters;
+    }
+
+    /**
+     * Resolve the addresses of advertisers to their identity, e.g. with
+     * mbed::callback(&resolver, &RpaResolver<>::resolve_identity). Resolution is opt-in, without
+     * a resolver peers are known by the address they advertise with. Use nullptr to remove it.
+     */
+    void set_identity_resolver(identity_resolver_t resolver)
+    {
+        post([this, resolver]() {
+            _identity_resolver = resolver;
+        });
+    }
+
+    /**
+     * Cancel the pending connection attempt. The peer is put in backoff once the cancellation
+     * completes and scanning resumes. Only use it from the event queue.
+     */
+    ble_error_t cancel_connection_attempt()
+    {
+        if (_connect_attempts.get_state() != ConnectionAttempts::CONNECTING) {
+            return BLE_ERROR_INVALID_STATE;
+        }
+
+        ble_error_t error = _counters.check(BLE_CALL_CANCEL_CONNECT, _ble.gap().cancelConnect());
+
+        if (error) {
+            print_error(error, "Error caused by Gap::cancelConnect");
+            /* we won't get a connection complete event, give up on the attempt */
+            cancel_post(_connect_attempts.take_timeout_event());
+            _connect_attempts.failed(_event_queue.tick());
+            post([this]() { start_activity(); });
+            return error;
+        }
+
+        _connect_attempts.cancelling();
+        return BLE_ERROR_NONE;
+    }
+
 protected:
     /**
      * Sets up adverting payload and start advertising.
@@ -202,12 +757,62 @@ protected:
             return;
         }
 
-        printf("Ble instance initialized\r\n");
+        _startup_stats.init_ms = _event_queue.tick() - _start_tick;
+        printf("Ble instance initialized in %lums\r\n", (unsigned long)_startup_stats.init_ms);
 
-        _event_queue.call([this]() { _post_init_cb(_ble, _event_queue); });
+        on_ready();
+    }
+
+    /** Run the post init callback and start activity, in the order requested. */
+    void on_ready()
+    {
+        if (_advertise_before_post_init) {
+            /* we already run on the event queue */
+            start_activity();
+        }
+
+        if (_post_init_cb) {
+            post([this]() { _post_init_cb(_ble, _event_queue); });
+        }
 
         /* All calls are serialised on the user thread through the event queue */
-        _event_queue.call([this]() { start_activity(); });
+        post([this]() { start_activity(); });
+    }
+
+    /** Stop advertising and scanning, periodic advertising and syncs, and close connections. */
+    void stop_activity()
+    {
+        ble::Gap &gap = _ble.gap();
+
+        if (gap.isAdvertisingActive(_adv_handle)) {
+            gap.stopAdvertising(_adv_handle);
+        }
+        stop_periodic_advertising();
+        terminate_periodic_syncs();
+        stop_scanning();
+
+        if (_connect_attempts.get_state() == ConnectionAttempts::CONNECTING) {
+            gap.cancelConnect();
+        }
+        if (_connected) {
+            gap.disconnect(_conn_handle, ble::local_disconnection_reason_t::USER_TERMINATION);
+        }
+    }
+
+    /** Forget the state of activity stopped by stop_activity() or BLE::shutdown(). */
+    void reset_activity_state()
+    {
+        _connected = false;
+        cancel_post(_connect_attempts.take_timeout_event());
+        _connect_attempts.reset();
+        _is_scanning = false;
+        _scan_resume_tick = _event_queue.tick();
+        _periodic_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+        cancel_post(_sync_attempts.take_timeout_event());
+        _sync_attempts.reset();
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            _syncs[i].used = false;
+        }
     }
 
     /**
@@ -216,15 +821,37 @@ protected:
      */
     void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
     {
-        _is_connecting = false;
+        const bool as_central = event.getOwnRole() == ble::connection_role_t::CENTRAL;
+
+        if (as_central) {
+            /* the attempt is over, don't hold event memory until the timeout expires */
+            cancel_post(_connect_attempts.take_timeout_event());
+            if (event.getStatus() == BLE_ERROR_NONE) {
+                _connect_attempts.succeeded();
+            } else {
+                _connect_attempts.failed(_event_queue.tick());
+            }
+        }
+
         if (event.getStatus() == BLE_ERROR_NONE) {
             _connected = true;
             _conn_handle = event.getConnectionHandle();
+            _counters.count(BLE_EVENT_CONNECTED);
             printf("Connected to: ");
             print_address(event.getPeerAddress());
+
+            if (as_central) {
+                /* reconnect to the peer by identity, its address will change */
+                _has_reconnect_identity = resolve_peer(
+                    event.getPeerAddressType(), event.getPeerAddress(), _reconnect_identity
+                );
+            }
         } else {
-            printf("Failed to connect\r\n");
-            _event_queue.call([this]() { start_activity(); });
+            _counters.count(BLE_EVENT_CONNECTION_FAILED);
+            if (!_connect_hook) {
+                printf("Failed to connect\r\n");
+            }
+            post([this]() { start_activity(); });
         }
     }
 
@@ -236,15 +863,18 @@ protected:
     {
         if (_connected) {
             _connected = false;
+            _counters.count(BLE_EVENT_DISCONNECTED);
             printf("Disconnected.\r\n");
-            _event_queue.call([this]() { start_activity(); });
+            /* the peer is likely to come back soon */
+            _scan_scheduler.expect_target();
+            post([this]() { start_activity(); });
         }
     }
 
     /** Restarts main activity */
     void onAdvertisingEnd(const ble::AdvertisingEndEvent &event)
     {
-        _event_queue.call([this]() { start_activity(); });
+        post([this]() { start_activity(); });
     }
 
     /**
@@ -262,10 +892,10 @@ protected:
             _ble.gap().stopAdvertising(_adv_handle);
         }
 
-        if (_target_name) {
+        if (is_scan_needed()) {
             start_scanning();
         } else {
-            _ble.gap().stopScan();
+            stop_scanning();
         }
     }
 
@@ -286,28 +916,27 @@ protected:
             ble::adv_interval_t(ble::millisecond_t(40))
         );
 
-        error = _ble.gap().setAdvertisingParameters(_adv_handle, adv_params);
+        error = _counters.check(
+            BLE_CALL_SET_ADVERTISING_PARAMETERS,
+            _ble.gap().setAdvertisingParameters(_adv_handle, adv_params)
+        );
 
         if (error) {
             printf("_ble.gap().setAdvertisingParameters() failed\r\n");
             return;
         }
 
-        uint8_t adv_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
-        ble::AdvertisingDataBuilder adv_data_builder(adv_buffer);
-        
-        adv_data_builder.clear();
-        adv_data_builder.setFlags();
-        error = adv_data_builder.setName(_advertising_name);
+        error = _adv_payloads.set_name(_advertising_name);
 
         if (error) {
-            print_error(error, "AdvertisingDataBuilder::setName() failed (name too long?)\r\n");
+            print_error(error, "AdvertisingPayloads::set_name() failed (name too long?)\r\n");
             return;
         }
 
-        /* Set payload for the set */
-        error = _ble.gap().setAdvertisingPayload(
-            _adv_handle, adv_data_builder.getAdvertisingData()
+        /* Set advertising and scan response payloads for the set */
+        error = _counters.check(
+            BLE_CALL_SET_ADVERTISING_PAYLOAD,
+            _adv_payloads.apply(_ble.gap(), _adv_handle)
         );
 
         if (error) {
@@ -315,48 +944,154 @@ protected:
             return;
         }
 
-        error = _ble.gap().startAdvertising(_adv_handle, ble::adv_duration_t(ble::second_t(10)));
+        error = _counters.check(
+            BLE_CALL_START_ADVERTISING,
+            _ble.gap().startAdvertising(_adv_handle, ble::adv_duration_t(ble::second_t(10)))
+        );
 
         if (error) {
             print_error(error, "Gap::startAdvertising() failed\r\n");
             return;
         }
 
+        _counters.count(BLE_EVENT_ADVERTISING_STARTED);
         printf("Advertising as \"%s\"\r\n", _advertising_name);
+
+        if (!_startup_stats.advertised) {
+            _startup_stats.advertised = true;
+            _startup_stats.first_advertising_ms = _event_queue.tick() - _start_tick;
+            printf("First advertisement %lums after start\r\n",
+                   (unsigned long)_startup_stats.first_advertising_ms);
+        }
+    }
+
+    /** Send modified payloads now or when the update interval since the last update has passed. */
+    void schedule_advertising_data_update()
+    {
+        if (_adv_update_pending) {
+            /* the pending update will pick up the latest payloads */
+            return;
+        }
+
+        uint32_t elapsed = _event_queue.tick() - _last_adv_update_tick;
+        uint32_t interval = _adv_update_interval.value();
+
+        if (elapsed >= interval) {
+            update_advertising_payloads();
+            return;
+        }
+
+        _adv_update_pending = true;
+        post_in(std::chrono::milliseconds(interval - elapsed), [this]() {
+            _adv_update_pending = false;
+            update_advertising_payloads();
+        });
+    }
+
+    /** Push modified payloads to the running advertising set. */
+    void update_advertising_payloads()
+    {
+        if (!_ble.hasInitialized() || !_ble.gap().isAdvertisingActive(_adv_handle)) {
+            /* the payloads will be sent when advertising starts */
+            return;
+        }
+
+        ble_error_t error = _counters.check(
+            BLE_CALL_UPDATE_ADVERTISING_PAYLOAD,
+            _adv_payloads.apply_changes(_ble.gap(), _adv_handle)
+        );
+        _last_adv_update_tick = _event_queue.tick();
+
+        if (error) {
+            print_error(error, "Gap::setAdvertisingPayload() failed\r\n");
+        }
+    }
+
+    /** We scan for the target while not connected and for periodic trains while syncs are free. */
+    bool is_scan_needed() const
+    {
+        return (_target_name && !_connected) ||
+               (_periodic_report_cb && find_sync_slot() >= 0) ||
+               _report_sink;
     }
 
     /** scan for GattServer */
     void start_scanning()
     {
-        if (_is_scanning || _connected || !_target_name) {
-            /* already connected or scan not needed */
+        if (_is_scanning || _connect_attempts.in_progress() || !is_scan_needed()) {
+            /* already scanning or connecting, or scan not needed */
+            return;
+        }
+
+        if ((int32_t)(_event_queue.tick() - _scan_resume_tick) < 0) {
+            /* backing off, scan will be restarted when the idle period ends */
             return;
         }
 
+        const bool coded_supported = _ble.gap().isFeatureSupported(
+            ble::controller_supported_features_t::LE_CODED_PHY
+        );
+        const ScanProfile &profile = _scan_scheduler.current_profile();
+
         ble::ScanParameters scan_params;
-        scan_params.set1mPhyConfiguration(ble::scan_interval_t(80), ble::scan_window_t(40), false);
-        _ble.gap().setScanParameters(scan_params);
+        _scan_scheduler.configure(scan_params, coded_supported);
+        ble_error_t ret = _counters.check(BLE_CALL_SET_SCAN_PARAMETERS, _ble.gap().setScanParameters(scan_params));
+
+        if (ret) {
+            print_error(ret, "Gap::setScanParameters() failed\r\n");
+            return;
+        }
 
-        ble_error_t ret = _ble.gap().startScan(ble::scan_duration_t(ble::second_t(10)));
+        ret = _counters.check(BLE_CALL_START_SCAN, _ble.gap().startScan(profile.duration));
 
         if (ret == ble_error_t::BLE_ERROR_NONE) {
             _is_scanning = true;
-            printf("Started scanning for \"%s\"\r\n", _target_name);
+            _counters.count(BLE_EVENT_SCAN_STARTED);
+            _scan_scheduler.on_scan_started(_event_queue.tick(), profile.coded_phy && coded_supported);
+            printf("Started scanning for \"%s\" (profile %u)\r\n",
+                   _target_name ? _target_name : (_periodic_report_cb ? "periodic advertising" : "reports"),
+                   (unsigned)_scan_scheduler.current_level());
         } else {
             printf("Starting scan failed\r\n");
         }
     }
 
-    /** Restarts main activity */
+    /** Stop the scan if running. */
+    ble_error_t stop_scanning()
+    {
+        if (!_is_scanning) {
+            return BLE_ERROR_NONE;
+        }
+
+        _scan_scheduler.on_scan_stopped(_event_queue.tick());
+        _is_scanning = false;
+
+        return _counters.check(BLE_CALL_STOP_SCAN, _ble.gap().stopScan());
+    }
+
+    /** Restarts main activity after the idle period of the scan profile */
     void onScanTimeout(const ble::ScanTimeoutEvent &event) override {
         _is_scanning = false;
-        _event_queue.call([this]() { start_activity(); });
+
+        uint32_t now = _event_queue.tick();
+        uint32_t idle_ms = _scan_scheduler.on_scan_stopped(now);
+        _scan_scheduler.print_stats(now);
+
+        _scan_resume_tick = now + idle_ms;
+        post_in(std::chrono::milliseconds(idle_ms), [this]() { start_activity(); });
     }
 
-    /** Check advertising report for name and connect to any device with the name GattServer */
+    /**
+     * Check advertising report for name and connect to any device with the name GattServer.
+     * A peer we were connected to is also recognised by its identity if its address resolves.
+     */
     void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override {
+        if (_periodic_report_cb && event.isPeriodicIntervalPresent()) {
+            create_periodic_sync(event);
+        }
+
         /* don't bother with analysing scan result if we're already connecting */
-        if (_is_connecting) {
+        if (_connect_attempts.in_progress() || _connected || !_target_name) {
             return;
         }
 
@@ -365,6 +1100,16 @@ protected:
             return;
         }
 
+        /* the identity outlives the private address, track the peer by it */
+        ble::address_t identity;
+        const bool resolved = resolve_peer(event.getPeerAddressType(), event.getPeerAddress(), identity);
+        const ble::address_t &peer = resolved ? identity : event.getPeerAddress();
+
+        if (resolved && _has_reconnect_identity && identity == _reconnect_identity) {
+            connect_to_target(event, peer);
+            return;
+        }
+
         ble::AdvertisingDataParser adv_data(event.getPayload());
 
         /* parse the advertising payload, looking for a discoverable device */
@@ -375,38 +1120,351 @@ protected:
             if (field.type == ble::adv_data_type_t::COMPLETE_LOCAL_NAME) {
                 if (field.value.size() == strlen(_target_name) &&
                     (memcmp(field.value.data(), _target_name, field.value.size()) == 0)) {
+                    connect_to_target(event, peer);
+                    return;
+                }
+            }
+        }
+    }
 
-                    printf("We found \"%s\", connecting...\r\n", _target_name);
+    /** True and the identity address of the peer if a resolver is set and the address resolves. */
+    bool resolve_peer(ble::peer_address_type_t address_type, const ble::address_t &address, ble::address_t &identity)
+    {
+        if (!_identity_resolver) {
+            return false;
+        }
 
-                    ble_error_t error = _ble.gap().stopScan();
+        return _identity_resolver(address_type, address, _event_queue.tick(), identity);
+    }
 
-                    if (error) {
-                        print_error(error, "Error caused by Gap::stopScan");
-                        return;
-                    }
+    /**
+     * Connect to the target that sent the report.
+     *
+     * @param peer Identity address of the peer if known, its advertised address otherwise.
+     */
+    void connect_to_target(const ble::AdvertisingReportEvent &event, const ble::address_t &peer)
+    {
+        if (!_connect_attempts.may_connect(peer, _event_queue.tick())) {
+            /* the peer failed recently, keep scanning until its backoff ends */
+            return;
+        }
 
-                    const ble::ConnectionParameters connection_params;
+        _scan_scheduler.on_target_found();
 
-                    error = _ble.gap().connect(
-                        event.getPeerAddressType(),
-                        event.getPeerAddress(),
-                        connection_params
-                    );
+        const ble::ConnectionParameters connection_params;
+        ble_error_t error;
 
-                    if (error) {
-                        _ble.gap().startScan();
-                        return;
-                    }
+        if (_connect_hook) {
+            /* nothing reaches the controller, the scan keeps running */
+            error = _connect_hook(event.getPeerAddressType(), event.getPeerAddress(), connection_params);
+        } else {
+            printf("We found \"%s\", connecting...\r\n", _target_name);
 
-                    /* we may have already scan events waiting
-                     * to be processed so we need to remember
-                     * that we are already connecting and ignore them */
-                    _is_connecting = true;
+            error = stop_scanning();
 
-                    return;
+            if (error) {
+                print_error(error, "Error caused by Gap::stopScan");
+                return;
+            }
+
+            error = _counters.check(BLE_CALL_CONNECT, _ble.gap().connect(
+                event.getPeerAddressType(),
+                event.getPeerAddress(),
+                connection_params
+            ));
+        }
+
+        /* we may have already scan events waiting
+         * to be processed so we need to remember
+         * that we are already connecting and ignore them */
+        _connect_attempts.seed(_ble.gap());
+        _connect_attempts.start(peer, _event_queue.tick());
+
+        if (error) {
+            print_error(error, "Error caused by Gap::connect");
+            _connect_attempts.failed(_event_queue.tick());
+            start_scanning();
+            return;
+        }
+
+        /* the peer may have gone, don't wait for it forever */
+        const uint32_t attempt_id = _connect_attempts.get_attempt_id();
+        _connect_attempts.set_timeout_event(post_in(
+            std::chrono::milliseconds(_connect_attempts.get_timeout_ms()),
+            [this, attempt_id]() { on_connection_timeout(attempt_id); }
+        ));
+    }
+
+    /** Cancel the connection attempt if the peer didn't answer in time */
+    void on_connection_timeout(uint32_t attempt_id)
+    {
+        if (attempt_id != _connect_attempts.get_attempt_id()) {
+            return;
+        }
+
+        /* this event is running, there is nothing left to cancel */
+        _connect_attempts.take_timeout_event();
+
+        if (_connect_attempts.has_timed_out(_event_queue.tick())) {
+            printf("Connection attempt timed out\r\n");
+            cancel_connection_attempt();
+        }
+    }
+
+    /** Index of a free sync slot or -1 if set_max_periodic_syncs() slots are used. */
+    int find_sync_slot() const
+    {
+        size_t used = 0;
+        int free_slot = -1;
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used) {
+                used++;
+            } else if (free_slot < 0) {
+                free_slot = i;
+            }
+        }
+        return used < _max_periodic_syncs ? free_slot : -1;
+    }
+
+    /** Sync to the periodic train advertised in the report unless we already track it. */
+    void create_periodic_sync(const ble::AdvertisingReportEvent &event)
+    {
+        if (_sync_attempts.in_progress()) {
+            /* the controller can only create one sync at a time */
+            return;
+        }
+
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used &&
+                _syncs[i].sid == event.getSID() &&
+                _syncs[i].peer_address == event.getPeerAddress()) {
+                return;
+            }
+        }
+
+        int slot = find_sync_slot();
+        if (slot < 0) {
+            return;
+        }
+
+        if (!_sync_attempts.may_connect(event.getPeerAddress(), _event_queue.tick())) {
+            /* the train failed recently, leave the slot to others until its backoff ends */
+            return;
+        }
+
+        if (_periodic_sync_filter && !_periodic_sync_filter(event)) {
+            return;
+        }
+
+        /* the sync is lost after missing around 6 periodic advertising events */
+        uint32_t timeout_ms = event.getPeriodicInterval().valueInMs() * 6;
+        if (timeout_ms < 100) {
+            timeout_ms = 100;
+        } else if (timeout_ms > 163840) {
+            timeout_ms = 163840;
+        }
+
+        ble_error_t error = _counters.check(BLE_CALL_CREATE_SYNC, _ble.gap().createSync(
+            event.getPeerAddressType(),
+            event.getPeerAddress(),
+            event.getSID(),
+            0,
+            ble::sync_timeout_t(ble::millisecond_t(timeout_ms))
+        ));
+
+        if (error) {
+            print_error(error, "Gap::createSync() failed\r\n");
+            return;
+        }
+
+        /* found a train, don't back off the scan */
+        _scan_scheduler.on_target_found();
+
+        _syncs[slot].used = true;
+        _syncs[slot].established = false;
+        _syncs[slot].sid = event.getSID();
+        _syncs[slot].peer_address = event.getPeerAddress();
+
+        _sync_attempts.seed(_ble.gap());
+        _sync_attempts.start(event.getPeerAddress(), _event_queue.tick());
+
+        /* the train may have gone, don't keep the controller waiting for it */
+        const uint32_t attempt_id = _sync_attempts.get_attempt_id();
+        _sync_attempts.set_timeout_event(post_in(
+            std::chrono::milliseconds(_sync_attempts.get_timeout_ms()),
+            [this, attempt_id]() { on_sync_timeout(attempt_id); }
+        ));
+    }
+
+    /** Cancel the sync creation if the train wasn't heard in time */
+    void on_sync_timeout(uint32_t attempt_id)
+    {
+        if (attempt_id != _sync_attempts.get_attempt_id()) {
+            return;
+        }
+
+        /* this event is running, there is nothing left to cancel */
+        _sync_attempts.take_timeout_event();
+
+        if (!_sync_attempts.has_timed_out(_event_queue.tick())) {
+            return;
+        }
+
+        printf("Periodic advertising sync timed out\r\n");
+
+        if (_ble.gap().cancelCreateSync()) {
+            /* we won't get a sync established event, give up on the sync */
+            _sync_attempts.failed(_event_queue.tick());
+            free_pending_sync();
+            post([this]() { start_activity(); });
+            return;
+        }
+
+        /* the sync established event will report the failure */
+        _sync_attempts.cancelling();
+    }
+
+    /** Free the slot of the sync being created. */
+    void free_pending_sync()
+    {
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used && !_syncs[i].established) {
+                _syncs[i].used = false;
+            }
+        }
+    }
+
+    /** Terminate all periodic syncs and cancel the pending one. */
+    void terminate_periodic_syncs()
+    {
+        if (_sync_attempts.in_progress()) {
+            _ble.gap().cancelCreateSync();
+            cancel_post(_sync_attempts.take_timeout_event());
+        }
+        /* a stopped sync isn't a failure of the train */
+        _sync_attempts.reset();
+
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used && _syncs[i].established) {
+                _ble.gap().terminateSync(_syncs[i].handle);
+            }
+            _syncs[i].used = false;
+        }
+    }
+
+    /** Record the sync handle or free the slot if the sync failed. */
+    void onPeriodicAdvertisingSyncEstablished(
+        const ble::PeriodicAdvertisingSyncEstablishedEvent &event
+    ) override {
+        cancel_post(_sync_attempts.take_timeout_event());
+        if (event.getStatus() == BLE_ERROR_NONE) {
+            _sync_attempts.succeeded();
+        } else {
+            _sync_attempts.failed(_event_queue.tick());
+        }
+
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used && !_syncs[i].established) {
+                if (event.getStatus() == BLE_ERROR_NONE && _periodic_report_cb) {
+                    _syncs[i].established = true;
+                    _syncs[i].handle = event.getSyncHandle();
+                    printf("Synced with periodic advertising of ");
+                    print_address(event.getPeerAddress());
+                } else {
+                    if (event.getStatus() == BLE_ERROR_NONE) {
+                        /* reports are no longer wanted */
+                        _ble.gap().terminateSync(event.getSyncHandle());
+                    }
+                    _syncs[i].used = false;
                 }
+                break;
+            }
+        }
+
+        post([this]() { start_activity(); });
+    }
+
+    /** Deliver periodic advertising data to the application. */
+    void onPeriodicAdvertisingReport(const ble::PeriodicAdvertisingReportEvent &event) override {
+        if (_periodic_report_cb) {
+            _periodic_report_cb(event);
+        }
+    }
+
+    /** Free the slot and resume scanning to find the train again. */
+    void onPeriodicAdvertisingSyncLoss(const ble::PeriodicAdvertisingSyncLoss &event) override {
+        for (size_t i = 0; i < MAX_PERIODIC_SYNCS; i++) {
+            if (_syncs[i].used && _syncs[i].established && _syncs[i].handle == event.getSyncHandle()) {
+                _syncs[i].used = false;
+                printf("Periodic advertising sync lost\r\n");
+                break;
             }
         }
+
+        /* the train is likely to still be around, look for it again right away */
+        _scan_scheduler.expect_target();
+        _scan_resume_tick = _event_queue.tick();
+
+        post([this]() { start_activity(); });
+    }
+
+    /**
+     * Post to the event queue and keep track of its depth and of failed posts.
+     * Any thread can post, the counters are updated atomically.
+     *
+     * @returns The event id or 0 if the queue is out of memory.
+     */
+    template<typename F>
+    int post(F f)
+    {
+        begin_post();
+        return end_post(_event_queue.call([this, f]() {
+            core_util_atomic_decr_u32(&_queue_stats.depth, 1);
+            f();
+        }));
+    }
+
+    /** Same as post() but the event runs after the delay. */
+    template<typename F>
+    int post_in(std::chrono::milliseconds delay, F f)
+    {
+        begin_post();
+        return end_post(_event_queue.call_in(delay, [this, f]() {
+            core_util_atomic_decr_u32(&_queue_stats.depth, 1);
+            f();
+        }));
+    }
+
+    /** Cancel an event posted with post() or post_in(), 0 is ignored. */
+    void cancel_post(int id)
+    {
+        if (id && _event_queue.cancel(id)) {
+            /* the event won't run to count itself out */
+            core_util_atomic_decr_u32(&_queue_stats.depth, 1);
+        }
+    }
+
+    void begin_post()
+    {
+        core_util_atomic_incr_u32(&_queue_stats.posts, 1);
+        /* count the event before posting, it may run before call() returns */
+        uint32_t depth = core_util_atomic_incr_u32(&_queue_stats.depth, 1);
+        /* posts may come from several contexts, don't let a lower depth overwrite a higher one */
+        uint32_t high_water = core_util_atomic_load_u32(&_queue_stats.high_water);
+        while (depth > high_water) {
+            if (core_util_atomic_cas_u32(&_queue_stats.high_water, &high_water, depth)) {
+                break;
+            }
+        }
+    }
+
+    int end_post(int id)
+    {
+        if (!id) {
+            core_util_atomic_decr_u32(&_queue_stats.depth, 1);
+            core_util_atomic_incr_u32(&_queue_stats.failed_posts, 1);
+        }
+        return id;
     }
 
     /**
@@ -414,7 +1472,8 @@ protected:
      */
     void schedule_ble_events(BLE::OnEventsToProcessCallbackContext *event)
     {
-        _event_queue.call(mbed::callback(&event->ble, &BLE::processEvents));
+        BLE *ble = &event->ble;
+        post([ble]() { ble->processEvents(); });
     }
 
 protected:
@@ -425,14 +1484,50 @@ protected:
     char *_target_name = nullptr;
     
     ble::advertising_handle_t _adv_handle = ble::LEGACY_ADVERTISING_HANDLE;
+    AdvertisingPayloads<ble::LEGACY_ADVERTISING_MAX_SIZE> _adv_payloads;
+    ble::millisecond_t _adv_update_interval = ble::millisecond_t(100);
+    uint32_t _last_adv_update_tick = 0;
+    bool _adv_update_pending = false;
 
     ble::connection_handle_t _conn_handle;
     bool _connected = false;
-    bool _is_connecting = false;
     bool _is_scanning = false;
+    ConnectionAttempts _connect_attempts;
+
+    identity_resolver_t _identity_resolver;
+    /* identity of the last target we connected to */
+    ble::address_t _reconnect_identity;
+    bool _has_reconnect_identity = false;
+
+    ble::advertising_handle_t _periodic_adv_handle = ble::INVALID_ADVERTISING_HANDLE;
+
+    struct periodic_sync_t {
+        bool used = false;
+        bool established = false;
+        ble::periodic_sync_handle_t handle = 0;
+        ble::advertising_sid_t sid = 0;
+        ble::address_t peer_address;
+    };
+    periodic_sync_t _syncs[MAX_PERIODIC_SYNCS];
+    size_t _max_periodic_syncs = 4;
+    ConnectionAttempts _sync_attempts;
+    periodic_sync_filter_t _periodic_sync_filter;
+    mbed::Callback<void(const ble::PeriodicAdvertisingReportEvent &event)> _periodic_report_cb;
+
+    ScanScheduler _scan_scheduler;
+    /* event queue tick before which we don't restart scanning */
+    uint32_t _scan_resume_tick = 0;
 
     mbed::Callback<void(BLE&, events::EventQueue&)> _post_init_cb;
-    ChainableGapEventHandler _gap_handler;
+    bool _advertise_before_post_init = false;
+    bool _ble_kept_initialized = false;
+    uint32_t _start_tick = 0;
+    startup_stats_t _startup_stats;
+    GapEventDispatcher _gap_handler;
+    event_queue_stats_t _queue_stats;
+    BleCounters _counters;
+    connect_hook_t _connect_hook;
+    AdvertisingReportSink *_report_sink = nullptr;
 };
 
 #endif /* BLE_APP_H_ */
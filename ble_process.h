@@ -28,6 +28,7 @@
 #include "Gap.h"
 #include "gap/AdvertisingDataParser.h"
 #include "ble/common/FunctionPointerWithContext.h"
+#include "advertising_payloads.h"
 
 
 static const uint16_t MAX_ADVERTISING_PAYLOAD_SIZE = 50;
@@ -46,8 +47,7 @@ public:
     BLEProcess(events::EventQueue &event_queue, BLE &ble_interface) :
         _event_queue(event_queue),
         _ble(ble_interface),
-        _gap(ble_interface.gap()),
-        _adv_data_builder(_adv_buffer)
+        _gap(ble_interface.gap())
     {
     }
 
@@ -123,6 +123,33 @@ public:
         _post_connect_cb = cb;
     }
 
+    /**
+     * Add or replace an AD field in the advertising or scan response payload. It will be sent
+     * the next time advertising starts. Only use it from the event queue.
+     *
+     * @returns BLE_ERROR_BUFFER_OVERFLOW if the field doesn't fit in the payload.
+     */
+    ble_error_t set_advertising_field(
+        ad_payload_t payload,
+        ble::adv_data_type_t type,
+        mbed::Span<const uint8_t> value
+    )
+    {
+        return _adv_payloads.set_field(payload, type, value);
+    }
+
+    /** Remove an AD field from the payloads. Only use it from the event queue. */
+    void remove_advertising_field(ble::adv_data_type_t type)
+    {
+        _adv_payloads.remove_field(type);
+    }
+
+    /** Choose the payload carrying the device name. Only use it from the event queue. */
+    void set_name_placement(ad_payload_t payload)
+    {
+        _adv_payloads.set_name_placement(payload);
+    }
+
     /** Name we advertise as. */
     virtual const char* get_device_name()
     {
@@ -218,14 +245,15 @@ protected:
             return;
         }
 
-        _adv_data_builder.clear();
-        _adv_data_builder.setFlags();
-        _adv_data_builder.setName(get_device_name());
+        error = _adv_payloads.set_name(get_device_name());
 
-        /* Set payload for the set */
-        error = _gap.setAdvertisingPayload(
-            _adv_handle, _adv_data_builder.getAdvertisingData()
-        );
+        if (error) {
+            print_error(error, "AdvertisingPayloads::set_name() failed (name too long?)\r\n");
+            return;
+        }
+
+        /* Set advertising and scan response payloads for the set */
+        error = _adv_payloads.apply(_gap, _adv_handle);
 
         if (error) {
             print_error(error, "Gap::setAdvertisingPayload() failed\r\n");
@@ -255,10 +283,8 @@ protected:
     BLE &_ble;
     ble::Gap &_gap;
 
-    uint8_t _adv_buffer[MAX_ADVERTISING_PAYLOAD_SIZE];
-    ble::AdvertisingDataBuilder _adv_data_builder;
-
     ble::advertising_handle_t _adv_handle = ble::LEGACY_ADVERTISING_HANDLE;
+    AdvertisingPayloads<ble::LEGACY_ADVERTISING_MAX_SIZE> _adv_payloads;
 
     mbed::Callback<void(BLE&, events::EventQueue&)> _post_init_cb;
     mbed::Callback<void(BLE&, events::EventQueue&, const ble::ConnectionCompleteEvent &event)> _post_connect_cb;
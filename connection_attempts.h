@@ -0,0 +1,309 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONNECTION_ATTEMPTS_H_
+#define CONNECTION_ATTEMPTS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "ble/BLE.h"
+
+static const size_t MAX_FAILED_PEERS = 8;
+
+/**
+ * State of the connection attempts of a central.
+ *
+ * An attempt starts with start(), is cancelled with Gap::cancelConnect() once it has been pending
+ * for longer than the timeout, and ends with succeeded() or failed(). Each failure puts the peer
+ * in a backoff period that doubles with every consecutive failure, with random jitter, up to a
+ * maximum. Peers in backoff are skipped by may_connect(), so a peer that stopped advertising
+ * can't keep the central connecting to it instead of scanning.
+ *
+ * The event cancelling the attempt on timeout is kept with set_timeout_event() so the owner can
+ * cancel it with take_timeout_event() when the attempt completes, instead of letting it hold
+ * event memory until it expires. Call seed() once Gap is initialized so devices that failed
+ * together don't retry in lockstep.
+ *
+ * Failures are remembered for the last MAX_FAILED_PEERS peers. All times are in milliseconds
+ * (e.g. EventQueue::tick()).
+ */
+class ConnectionAttempts
+{
+public:
+    enum state_t {
+        IDLE,
+        CONNECTING,
+        CANCELLING
+    };
+
+    /** Time after which a pending attempt is cancelled. */
+    void set_timeout(ble::millisecond_t timeout)
+    {
+        _timeout_ms = timeout.value();
+    }
+
+    uint32_t get_timeout_ms() const
+    {
+        return _timeout_ms;
+    }
+
+    /**
+     * Configure the backoff after a failure.
+     *
+     * @param base Backoff after the first failure, doubled after each consecutive failure.
+     * @param max Longest backoff.
+     * @param jitter_permille Random variation of the backoff, in permille of it.
+     */
+    void set_backoff(ble::millisecond_t base, ble::millisecond_t max, uint16_t jitter_permille)
+    {
+        _backoff_base_ms = base.value();
+        _backoff_max_ms = max.value();
+        _jitter_permille = jitter_permille > 1000 ? 1000 : jitter_permille;
+    }
+
+    /** Seed the jitter with the address of the device, only the first call has an effect. */
+    void seed(ble::Gap &gap)
+    {
+        if (_seeded) {
+            return;
+        }
+
+        ble::own_address_type_t address_type;
+        ble::address_t address;
+        if (gap.getAddress(address_type, address)) {
+            return;
+        }
+        _seeded = true;
+
+        /* FNV-1a of the address */
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < address.size(); i++) {
+            hash = (hash ^ address[i]) * 16777619u;
+        }
+        /* xorshift never leaves 0 */
+        _random = hash ? hash : _random;
+    }
+
+    /** Remember the event cancelling the current attempt on timeout. */
+    void set_timeout_event(int id)
+    {
+        _timeout_event = id;
+    }
+
+    /** Event set by set_timeout_event(), 0 if none. It is forgotten, cancel it if needed. */
+    int take_timeout_event()
+    {
+        int id = _timeout_event;
+        _timeout_event = 0;
+        return id;
+    }
+
+    state_t get_state() const
+    {
+        return _state;
+    }
+
+    /** True while an attempt is pending or being cancelled. */
+    bool in_progress() const
+    {
+        return _state != IDLE;
+    }
+
+    /** Identifies the current attempt, to recognise stale timeouts. */
+    uint32_t get_attempt_id() const
+    {
+        return _attempt_id;
+    }
+
+    /** False if an attempt is in progress or the peer is in backoff. */
+    bool may_connect(const ble::address_t &address, uint32_t now) const
+    {
+        if (in_progress()) {
+            return false;
+        }
+
+        const failed_peer_t *peer = find(address);
+        return !peer || (int32_t)(now - peer->retry_tick) >= 0;
+    }
+
+    /** Call once Gap::connect() has accepted the attempt. */
+    void start(const ble::address_t &address, uint32_t now)
+    {
+        _state = CONNECTING;
+        _address = address;
+        _start_tick = now;
+        _attempt_id++;
+        _attempts++;
+    }
+
+    /** True if the current attempt has been pending for longer than the timeout. */
+    bool has_timed_out(uint32_t now) const
+    {
+        return _state == CONNECTING && (now - _start_tick) >= _timeout_ms;
+    }
+
+    /** Call once Gap::cancelConnect() has been accepted. */
+    void cancelling()
+    {
+        _state = CANCELLING;
+        _timeouts++;
+    }
+
+    /** The attempt has completed, the peer is forgotten. */
+    void succeeded()
+    {
+        if (_state == IDLE) {
+            return;
+        }
+        _state = IDLE;
+
+        failed_peer_t *peer = find(_address);
+        if (peer) {
+            peer->used = false;
+        }
+    }
+
+    /** The attempt failed or has been cancelled, the peer is put in backoff. */
+    void failed(uint32_t now)
+    {
+        if (_state == IDLE) {
+            return;
+        }
+        _state = IDLE;
+        _failures++;
+
+        failed_peer_t *peer = find(_address);
+        if (!peer) {
+            peer = allocate();
+            peer->used = true;
+            peer->address = _address;
+            peer->failures = 0;
+        }
+
+        if (peer->failures < 31) {
+            peer->failures++;
+        }
+
+        uint32_t backoff = _backoff_base_ms;
+        for (uint8_t i = 1; i < peer->failures && backoff < _backoff_max_ms; i++) {
+            backoff *= 2;
+        }
+        if (backoff > _backoff_max_ms) {
+            backoff = _backoff_max_ms;
+        }
+
+        /* spread the retries of peers that failed together */
+        uint32_t jitter = (uint64_t)backoff * _jitter_permille / 1000;
+        if (jitter) {
+            backoff = backoff - jitter + next_random() % (2 * jitter + 1);
+        }
+
+        peer->retry_tick = now + backoff;
+    }
+
+    /** Forget all failures and any attempt in progress. */
+    void reset()
+    {
+        _state = IDLE;
+        _timeout_event = 0;
+        for (size_t i = 0; i < MAX_FAILED_PEERS; i++) {
+            _peers[i].used = false;
+        }
+    }
+
+    /** Consecutive failures of the peer, 0 if it's not in backoff. */
+    uint8_t get_failures(const ble::address_t &address) const
+    {
+        const failed_peer_t *peer = find(address);
+        return peer ? peer->failures : 0;
+    }
+
+    void print_stats() const
+    {
+        printf("Connection attempts %lu, failures %lu, timeouts %lu\r\n",
+               (unsigned long)_attempts, (unsigned long)_failures, (unsigned long)_timeouts);
+    }
+
+private:
+    struct failed_peer_t {
+        bool used = false;
+        ble::address_t address;
+        uint8_t failures = 0;
+        uint32_t retry_tick = 0;
+    };
+
+    const failed_peer_t* find(const ble::address_t &address) const
+    {
+        for (size_t i = 0; i < MAX_FAILED_PEERS; i++) {
+            if (_peers[i].used && _peers[i].address == address) {
+                return &_peers[i];
+            }
+        }
+        return nullptr;
+    }
+
+    failed_peer_t* find(const ble::address_t &address)
+    {
+        return const_cast<failed_peer_t*>(static_cast<const ConnectionAttempts*>(this)->find(address));
+    }
+
+    /** Free entry or the one whose backoff ends first. */
+    failed_peer_t* allocate()
+    {
+        failed_peer_t *oldest = &_peers[0];
+        for (size_t i = 0; i < MAX_FAILED_PEERS; i++) {
+            if (!_peers[i].used) {
+                return &_peers[i];
+            }
+            if ((int32_t)(_peers[i].retry_tick - oldest->retry_tick) < 0) {
+                oldest = &_peers[i];
+            }
+        }
+        return oldest;
+    }
+
+    /** xorshift32 */
+    uint32_t next_random()
+    {
+        _random ^= _random << 13;
+        _random ^= _random >> 17;
+        _random ^= _random << 5;
+        return _random;
+    }
+
+private:
+    state_t _state = IDLE;
+    ble::address_t _address;
+    uint32_t _start_tick = 0;
+    uint32_t _attempt_id = 0;
+    int _timeout_event = 0;
+
+    uint32_t _timeout_ms = 3000;
+    uint32_t _backoff_base_ms = 1000;
+    uint32_t _backoff_max_ms = 60000;
+    uint16_t _jitter_permille = 250;
+
+    failed_peer_t _peers[MAX_FAILED_PEERS];
+    uint32_t _random = 0x9E3779B9;
+    bool _seeded = false;
+
+    uint32_t _attempts = 0;
+    uint32_t _failures = 0;
+    uint32_t _timeouts = 0;
+};
+
+#endif /* CONNECTION_ATTEMPTS_H_ */
@@ -0,0 +1,260 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GAP_EVENT_DISPATCHER_H_
+#define GAP_EVENT_DISPATCHER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ble/BLE.h"
+#include "platform/NonCopyable.h"
+
+static const size_t MAX_GAP_EVENT_HANDLERS = 8;
+
+/**
+ * Gap events a handler can subscribe to, combine them to build a mask. There is one per method
+ * of ble::Gap::EventHandler, so GAP_EVENT_ALL forwards everything a handler can implement.
+ */
+enum gap_event_mask_t : uint32_t {
+    GAP_EVENT_SCAN_REQUEST_RECEIVED = 1 << 0,
+    GAP_EVENT_ADVERTISING_END = 1 << 1,
+    GAP_EVENT_ADVERTISING_REPORT = 1 << 2,
+    GAP_EVENT_SCAN_TIMEOUT = 1 << 3,
+    GAP_EVENT_PERIODIC_SYNC_ESTABLISHED = 1 << 4,
+    GAP_EVENT_PERIODIC_ADVERTISING_REPORT = 1 << 5,
+    GAP_EVENT_PERIODIC_SYNC_LOSS = 1 << 6,
+    GAP_EVENT_CONNECTION_COMPLETE = 1 << 7,
+    GAP_EVENT_UPDATE_CONNECTION_PARAMETERS_REQUEST = 1 << 8,
+    GAP_EVENT_CONNECTION_PARAMETERS_UPDATE_COMPLETE = 1 << 9,
+    GAP_EVENT_READ_PHY = 1 << 10,
+    GAP_EVENT_PHY_UPDATE_COMPLETE = 1 << 11,
+    GAP_EVENT_DATA_LENGTH_CHANGE = 1 << 12,
+    GAP_EVENT_DISCONNECTION_COMPLETE = 1 << 13,
+    GAP_EVENT_PRIVACY_ENABLED = 1 << 14,
+    GAP_EVENT_ADVERTISING_START = 1 << 15,
+    GAP_EVENT_ALL = (1 << 16) - 1
+};
+
+/**
+ * Gap event handler forwarding events to the handlers that subscribed to them.
+ *
+ * Each handler registers with a mask of the events it wants. A table of handlers is kept per
+ * event so an event only costs a virtual call per subscribed handler. This matters for
+ * frequent events like advertising reports when several handlers are attached but only one
+ * of them looks at the reports.
+ */
+class GapEventDispatcher : private mbed::NonCopyable<GapEventDispatcher>, public ble::Gap::EventHandler
+{
+public:
+    /**
+     * Register a handler for the events in the mask. A handler already registered gets the
+     * new events added to its subscription.
+     *
+     * @returns False if the table of one of the events is full, nothing is registered then.
+     */
+    bool add_event_handler(ble::Gap::EventHandler *handler, uint32_t mask = GAP_EVENT_ALL)
+    {
+        if (!handler) {
+            return false;
+        }
+
+        for (size_t event = 0; event < EVENT_COUNT; event++) {
+            if ((mask & (1u << event)) && !contains(event, handler) &&
+                _counts[event] == MAX_GAP_EVENT_HANDLERS) {
+                return false;
+            }
+        }
+
+        for (size_t event = 0; event < EVENT_COUNT; event++) {
+            if ((mask & (1u << event)) && !contains(event, handler)) {
+                _handlers[event][_counts[event]++] = handler;
+            }
+        }
+
+        return true;
+    }
+
+    /** Unsubscribe the handler from all events. */
+    void remove_event_handler(ble::Gap::EventHandler *handler)
+    {
+        for (size_t event = 0; event < EVENT_COUNT; event++) {
+            for (size_t i = 0; i < _counts[event]; i++) {
+                if (_handlers[event][i] == handler) {
+                    /* keep the registration order */
+                    for (size_t j = i + 1; j < _counts[event]; j++) {
+                        _handlers[event][j - 1] = _handlers[event][j];
+                    }
+                    _counts[event]--;
+                    break;
+                }
+            }
+        }
+    }
+
+    /** Unsubscribe all handlers. */
+    void clear()
+    {
+        for (size_t event = 0; event < EVENT_COUNT; event++) {
+            _counts[event] = 0;
+        }
+    }
+
+    /** Number of handlers subscribed to a single event. */
+    size_t get_handler_count(gap_event_mask_t event) const
+    {
+        for (size_t i = 0; i < EVENT_COUNT; i++) {
+            if (event == (1u << i)) {
+                return _counts[i];
+            }
+        }
+        return 0;
+    }
+
+    void onScanRequestReceived(const ble::ScanRequestEvent &event) override
+    {
+        dispatch<GAP_EVENT_SCAN_REQUEST_RECEIVED>(&ble::Gap::EventHandler::onScanRequestReceived, event);
+    }
+
+    void onAdvertisingStart(const ble::AdvertisingStartEvent &event) override
+    {
+        dispatch<GAP_EVENT_ADVERTISING_START>(&ble::Gap::EventHandler::onAdvertisingStart, event);
+    }
+
+    void onAdvertisingEnd(const ble::AdvertisingEndEvent &event) override
+    {
+        dispatch<GAP_EVENT_ADVERTISING_END>(&ble::Gap::EventHandler::onAdvertisingEnd, event);
+    }
+
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override
+    {
+        dispatch<GAP_EVENT_ADVERTISING_REPORT>(&ble::Gap::EventHandler::onAdvertisingReport, event);
+    }
+
+    void onScanTimeout(const ble::ScanTimeoutEvent &event) override
+    {
+        dispatch<GAP_EVENT_SCAN_TIMEOUT>(&ble::Gap::EventHandler::onScanTimeout, event);
+    }
+
+    void onPeriodicAdvertisingSyncEstablished(
+        const ble::PeriodicAdvertisingSyncEstablishedEvent &event
+    ) override
+    {
+        dispatch<GAP_EVENT_PERIODIC_SYNC_ESTABLISHED>(&ble::Gap::EventHandler::onPeriodicAdvertisingSyncEstablished, event);
+    }
+
+    void onPeriodicAdvertisingReport(const ble::PeriodicAdvertisingReportEvent &event) override
+    {
+        dispatch<GAP_EVENT_PERIODIC_ADVERTISING_REPORT>(&ble::Gap::EventHandler::onPeriodicAdvertisingReport, event);
+    }
+
+    void onPeriodicAdvertisingSyncLoss(const ble::PeriodicAdvertisingSyncLoss &event) override
+    {
+        dispatch<GAP_EVENT_PERIODIC_SYNC_LOSS>(&ble::Gap::EventHandler::onPeriodicAdvertisingSyncLoss, event);
+    }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        dispatch<GAP_EVENT_CONNECTION_COMPLETE>(&ble::Gap::EventHandler::onConnectionComplete, event);
+    }
+
+    void onUpdateConnectionParametersRequest(
+        const ble::UpdateConnectionParametersRequestEvent &event
+    ) override
+    {
+        dispatch<GAP_EVENT_UPDATE_CONNECTION_PARAMETERS_REQUEST>(&ble::Gap::EventHandler::onUpdateConnectionParametersRequest, event);
+    }
+
+    void onConnectionParametersUpdateComplete(
+        const ble::ConnectionParametersUpdateCompleteEvent &event
+    ) override
+    {
+        dispatch<GAP_EVENT_CONNECTION_PARAMETERS_UPDATE_COMPLETE>(&ble::Gap::EventHandler::onConnectionParametersUpdateComplete, event);
+    }
+
+    void onReadPhy(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        dispatch<GAP_EVENT_READ_PHY>(&ble::Gap::EventHandler::onReadPhy, status, connectionHandle, txPhy, rxPhy);
+    }
+
+    void onPhyUpdateComplete(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        dispatch<GAP_EVENT_PHY_UPDATE_COMPLETE>(&ble::Gap::EventHandler::onPhyUpdateComplete, status, connectionHandle, txPhy, rxPhy);
+    }
+
+    void onDataLengthChange(
+        ble::connection_handle_t connectionHandle,
+        uint16_t txSize,
+        uint16_t rxSize
+    ) override
+    {
+        dispatch<GAP_EVENT_DATA_LENGTH_CHANGE>(&ble::Gap::EventHandler::onDataLengthChange, connectionHandle, txSize, rxSize);
+    }
+
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
+    {
+        dispatch<GAP_EVENT_DISCONNECTION_COMPLETE>(&ble::Gap::EventHandler::onDisconnectionComplete, event);
+    }
+
+    void onPrivacyEnabled() override
+    {
+        dispatch<GAP_EVENT_PRIVACY_ENABLED>(&ble::Gap::EventHandler::onPrivacyEnabled);
+    }
+
+private:
+    static const size_t EVENT_COUNT = 16;
+
+    bool contains(size_t event, ble::Gap::EventHandler *handler) const
+    {
+        for (size_t i = 0; i < _counts[event]; i++) {
+            if (_handlers[event][i] == handler) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Index of the event in the tables. */
+    static constexpr size_t index_of(uint32_t mask, size_t index = 0)
+    {
+        return (mask & 1) ? index : index_of(mask >> 1, index + 1);
+    }
+
+    /** Call the method on the handlers subscribed to the event. */
+    template<uint32_t Event, typename... Params, typename... Args>
+    void dispatch(void (ble::Gap::EventHandler::*method)(Params...), const Args&... args)
+    {
+        constexpr size_t index = index_of(Event);
+        for (size_t i = 0; i < _counts[index]; i++) {
+            (_handlers[index][i]->*method)(args...);
+        }
+    }
+
+private:
+    ble::Gap::EventHandler *_handlers[EVENT_COUNT][MAX_GAP_EVENT_HANDLERS];
+    uint8_t _counts[EVENT_COUNT] = { 0 };
+};
+
+#endif /* GAP_EVENT_DISPATCHER_H_ */
@@ -0,0 +1,745 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GAP_EVENT_TRACE_H_
+#define GAP_EVENT_TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "advertising_event_type.h"
+#include "ble/BLE.h"
+#include "events/mbed_events.h"
+#include "platform/Callback.h"
+#include "platform/NonCopyable.h"
+#include "platform/Span.h"
+#include "platform/mbed_assert.h"
+#include "platform/mbed_atomic.h"
+
+/*
+ * Trace format, all integers little endian:
+ *
+ * header: "BLET" version(u8)
+ * record: type(u8) timestamp_ms(u32) length(u16) body[length]
+ *
+ * Bodies of the records are described next to the writing code in GapEventRecorder.
+ */
+
+static const uint8_t GAP_EVENT_TRACE_VERSION = 1;
+static const size_t GAP_EVENT_TRACE_MAX_BODY_SIZE = 300;
+
+/** Types of the records in a trace. */
+enum gap_trace_record_t : uint8_t {
+    GAP_TRACE_ADVERTISING_REPORT = 1,
+    GAP_TRACE_CONNECTION_COMPLETE = 2,
+    GAP_TRACE_DISCONNECTION_COMPLETE = 3,
+    GAP_TRACE_SCAN_TIMEOUT = 4,
+    GAP_TRACE_ADVERTISING_END = 5
+};
+
+/**
+ * Records the Gap events it receives into a binary trace file.
+ *
+ * Advertising report payloads longer than the record body allows are truncated.
+ *
+ * Records are appended to a RAM buffer split in two halves so writing the file doesn't slow down
+ * the BLE event queue and skew the timing being captured. When a half is full it is written in
+ * one go, on the write queue if one is given (e.g. a low priority thread), while the other half
+ * fills. Records arriving while both halves are full are dropped and counted as write errors.
+ * Call flush() once recording is over to write the records left.
+ *
+ * Add it to BLEApp with add_gap_event_handler(). For BLEProcess, construct it with the process
+ * as the forward handler and install it with ble.gap().setEventHandler() in the post init
+ * callback; events are then recorded and passed on to the process. Events that aren't recorded
+ * are passed on too, the recorder implements every method of ble::Gap::EventHandler.
+ *
+ * Timestamps come from the clock given at construction, e.g. EventQueue::tick().
+ */
+class GapEventRecorder : private mbed::NonCopyable<GapEventRecorder>, public ble::Gap::EventHandler
+{
+public:
+    /**
+     * @param file Trace file.
+     * @param clock Source of the timestamps in milliseconds.
+     * @param buffer Buffer of the records, it must outlive the recorder. Each half must hold at
+     * least one record (7 bytes of header and GAP_EVENT_TRACE_MAX_BODY_SIZE).
+     * @param write_queue Queue writing the file, nullptr to write from the event context.
+     * @param forward Handler the events are passed on to.
+     */
+    GapEventRecorder(
+        FILE *file,
+        mbed::Callback<uint32_t()> clock,
+        mbed::Span<uint8_t> buffer,
+        events::EventQueue *write_queue = nullptr,
+        ble::Gap::EventHandler *forward = nullptr
+    ) :
+        _file(file),
+        _clock(clock),
+        _forward(forward),
+        _buffer(buffer.data()),
+        _half_size(buffer.size() / 2),
+        _write_queue(write_queue)
+    {
+        MBED_ASSERT(_half_size >= RECORD_HEADER_SIZE + GAP_EVENT_TRACE_MAX_BODY_SIZE);
+
+        static const uint8_t header[] = { 'B', 'L', 'E', 'T', GAP_EVENT_TRACE_VERSION };
+        if (fwrite(header, sizeof(header), 1, _file) != 1) {
+            _write_errors++;
+        }
+        _epoch = _clock();
+    }
+
+    /**
+     * Write the records buffered so far, in the call. Call it from the context the events are
+     * recorded in, e.g. once recording is over.
+     *
+     * @returns False if the other half is still being written on the write queue, try again
+     * later.
+     */
+    bool flush()
+    {
+        if (core_util_atomic_load_bool(&_writing)) {
+            return false;
+        }
+        write(_buffer + _active * _half_size, _fill);
+        _fill = 0;
+        fflush(_file);
+        return true;
+    }
+
+    /** Number of records buffered for writing. */
+    uint32_t get_record_count() const
+    {
+        return _records;
+    }
+
+    /** Number of records dropped or lost to failed writes, a failed write counts once. */
+    uint32_t get_write_error_count() const
+    {
+        return core_util_atomic_load_u32(&_write_errors);
+    }
+
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override
+    {
+        /* type, peer address type, peer address, primary phy, secondary phy, sid, tx power,
+         * rssi, periodic interval(u16), direct address type, direct address, payload */
+        mbed::Span<const uint8_t> payload = event.getPayload();
+        size_t payload_size = payload.size();
+        if (payload_size > GAP_EVENT_TRACE_MAX_BODY_SIZE - 22) {
+            payload_size = GAP_EVENT_TRACE_MAX_BODY_SIZE - 22;
+        }
+
+        begin();
+        put_u8(advertising_event_to_bits(event.getType()));
+        put_u8(event.getPeerAddressType().value());
+        put_bytes(event.getPeerAddress().data(), 6);
+        put_u8(event.getPrimaryPhy().value());
+        put_u8(event.getSecondaryPhy().value());
+        put_u8(event.getSID());
+        put_u8(event.getTxPower());
+        put_u8(event.getRssi());
+        put_u16(event.isPeriodicIntervalPresent() ? event.getPeriodicInterval().value() : 0);
+        put_u8(event.getDirectAddressType().value());
+        put_bytes(event.getDirectAddress().data(), 6);
+        put_bytes(payload.data(), payload_size);
+        commit(GAP_TRACE_ADVERTISING_REPORT);
+
+        if (_forward) {
+            _forward->onAdvertisingReport(event);
+        }
+    }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        /* status(u16), handle(u16), own role, peer address type, peer address, local rpa,
+         * peer rpa, interval(u16), latency(u16), supervision timeout(u16) */
+        begin();
+        put_u16(event.getStatus());
+        put_u16(event.getConnectionHandle());
+        put_u8(event.getOwnRole().value());
+        put_u8(event.getPeerAddressType().value());
+        put_bytes(event.getPeerAddress().data(), 6);
+        put_bytes(event.getLocalResolvablePrivateAddress().data(), 6);
+        put_bytes(event.getPeerResolvablePrivateAddress().data(), 6);
+        put_u16(event.getConnectionInterval().value());
+        put_u16(event.getConnectionLatency().value());
+        put_u16(event.getSupervisionTimeout().value());
+        commit(GAP_TRACE_CONNECTION_COMPLETE);
+
+        if (_forward) {
+            _forward->onConnectionComplete(event);
+        }
+    }
+
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
+    {
+        /* handle(u16), reason */
+        begin();
+        put_u16(event.getConnectionHandle());
+        put_u8(event.getReason().value());
+        commit(GAP_TRACE_DISCONNECTION_COMPLETE);
+
+        if (_forward) {
+            _forward->onDisconnectionComplete(event);
+        }
+    }
+
+    void onScanTimeout(const ble::ScanTimeoutEvent &event) override
+    {
+        /* no body */
+        begin();
+        commit(GAP_TRACE_SCAN_TIMEOUT);
+
+        if (_forward) {
+            _forward->onScanTimeout(event);
+        }
+    }
+
+    void onAdvertisingEnd(const ble::AdvertisingEndEvent &event) override
+    {
+        /* advertising handle, connection handle(u16), completed events, connected */
+        begin();
+        put_u8(event.getAdvHandle());
+        put_u16(event.getConnection());
+        put_u8(event.getCompleted_events());
+        put_u8(event.isConnected());
+        commit(GAP_TRACE_ADVERTISING_END);
+
+        if (_forward) {
+            _forward->onAdvertisingEnd(event);
+        }
+    }
+
+    /* events passed on without being recorded */
+
+    void onScanRequestReceived(const ble::ScanRequestEvent &event) override
+    {
+        if (_forward) {
+            _forward->onScanRequestReceived(event);
+        }
+    }
+
+    void onAdvertisingStart(const ble::AdvertisingStartEvent &event) override
+    {
+        if (_forward) {
+            _forward->onAdvertisingStart(event);
+        }
+    }
+
+    void onPeriodicAdvertisingSyncEstablished(
+        const ble::PeriodicAdvertisingSyncEstablishedEvent &event
+    ) override
+    {
+        if (_forward) {
+            _forward->onPeriodicAdvertisingSyncEstablished(event);
+        }
+    }
+
+    void onPeriodicAdvertisingReport(const ble::PeriodicAdvertisingReportEvent &event) override
+    {
+        if (_forward) {
+            _forward->onPeriodicAdvertisingReport(event);
+        }
+    }
+
+    void onPeriodicAdvertisingSyncLoss(const ble::PeriodicAdvertisingSyncLoss &event) override
+    {
+        if (_forward) {
+            _forward->onPeriodicAdvertisingSyncLoss(event);
+        }
+    }
+
+    void onUpdateConnectionParametersRequest(
+        const ble::UpdateConnectionParametersRequestEvent &event
+    ) override
+    {
+        if (_forward) {
+            _forward->onUpdateConnectionParametersRequest(event);
+        }
+    }
+
+    void onConnectionParametersUpdateComplete(
+        const ble::ConnectionParametersUpdateCompleteEvent &event
+    ) override
+    {
+        if (_forward) {
+            _forward->onConnectionParametersUpdateComplete(event);
+        }
+    }
+
+    void onReadPhy(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        if (_forward) {
+            _forward->onReadPhy(status, connectionHandle, txPhy, rxPhy);
+        }
+    }
+
+    void onPhyUpdateComplete(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        if (_forward) {
+            _forward->onPhyUpdateComplete(status, connectionHandle, txPhy, rxPhy);
+        }
+    }
+
+    void onDataLengthChange(
+        ble::connection_handle_t connectionHandle,
+        uint16_t txSize,
+        uint16_t rxSize
+    ) override
+    {
+        if (_forward) {
+            _forward->onDataLengthChange(connectionHandle, txSize, rxSize);
+        }
+    }
+
+    void onPrivacyEnabled() override
+    {
+        if (_forward) {
+            _forward->onPrivacyEnabled();
+        }
+    }
+
+private:
+    void begin()
+    {
+        _size = 0;
+    }
+
+    void put_u8(uint8_t value)
+    {
+        if (_size < sizeof(_body)) {
+            _body[_size++] = value;
+        }
+    }
+
+    void put_u16(uint16_t value)
+    {
+        put_u8(value & 0xFF);
+        put_u8(value >> 8);
+    }
+
+    void put_bytes(const uint8_t *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++) {
+            put_u8(data[i]);
+        }
+    }
+
+    void commit(gap_trace_record_t type)
+    {
+        uint32_t timestamp = _clock() - _epoch;
+        uint8_t header[RECORD_HEADER_SIZE] = {
+            type,
+            (uint8_t)(timestamp), (uint8_t)(timestamp >> 8),
+            (uint8_t)(timestamp >> 16), (uint8_t)(timestamp >> 24),
+            (uint8_t)(_size), (uint8_t)(_size >> 8)
+        };
+
+        if (_fill + sizeof(header) + _size > _half_size && !swap()) {
+            core_util_atomic_incr_u32(&_write_errors, 1);
+            return;
+        }
+
+        uint8_t *half = _buffer + _active * _half_size;
+        memcpy(half + _fill, header, sizeof(header));
+        memcpy(half + _fill + sizeof(header), _body, _size);
+        _fill += sizeof(header) + _size;
+        _records++;
+    }
+
+    /** Hand the full half over to be written and fill the other one. */
+    bool swap()
+    {
+        if (core_util_atomic_exchange_bool(&_writing, true)) {
+            /* the other half hasn't been written yet */
+            return false;
+        }
+
+        const uint8_t *full = _buffer + _active * _half_size;
+        const size_t size = _fill;
+        _active = !_active;
+        _fill = 0;
+
+        if (!_write_queue || !_write_queue->call([this, full, size]() { write_half(full, size); })) {
+            write_half(full, size);
+        }
+        return true;
+    }
+
+    void write_half(const uint8_t *data, size_t size)
+    {
+        write(data, size);
+        core_util_atomic_store_bool(&_writing, false);
+    }
+
+    void write(const uint8_t *data, size_t size)
+    {
+        if (size && fwrite(data, size, 1, _file) != 1) {
+            core_util_atomic_incr_u32(&_write_errors, 1);
+        }
+    }
+
+private:
+    static const size_t RECORD_HEADER_SIZE = 7;
+
+    FILE *_file;
+    mbed::Callback<uint32_t()> _clock;
+    ble::Gap::EventHandler *_forward;
+    uint32_t _epoch = 0;
+
+    uint8_t *_buffer;
+    const size_t _half_size;
+    events::EventQueue *_write_queue;
+    uint8_t _active = 0;
+    size_t _fill = 0;
+    bool _writing = false;
+
+    uint8_t _body[GAP_EVENT_TRACE_MAX_BODY_SIZE];
+    size_t _size = 0;
+
+    uint32_t _records = 0;
+    uint32_t _write_errors = 0;
+};
+
+/**
+ * Feeds the events of a trace recorded by GapEventRecorder into a Gap event handler. Events are
+ * replayed as fast as possible or with the timing of the recording.
+ *
+ * Use start() to replay on the event queue of the application: each event is posted once the
+ * previous one has been handled, so the events the handler posts in turn run in between and
+ * the queue doesn't fill up however fast the trace goes. replay() calls the handler in a loop
+ * and suits handlers doing all their work in the call.
+ *
+ * The header only needs the Gap event types, mbed::Callback and the events library. To replay
+ * on a Linux host, build the application with the BLE and events of mbed-os compiled for the
+ * host as its unit tests do (the BLE fakes of connectivity/FEATURE_BLE/tests and the posix
+ * equeue), read the trace with fopen() and call start() before dispatching the queue forever.
+ */
+class GapEventReplayer : private mbed::NonCopyable<GapEventReplayer>
+{
+public:
+    enum replay_mode_t {
+        AS_FAST_AS_POSSIBLE,
+        ORIGINAL_TIMING
+    };
+
+    explicit GapEventReplayer(FILE *file) : _file(file)
+    {
+    }
+
+    /**
+     * Replay the whole trace in the call.
+     *
+     * @param handler Handler receiving the events.
+     * @param mode Replay speed.
+     * @param wait Called with the number of milliseconds to wait before the next event,
+     * required with ORIGINAL_TIMING.
+     *
+     * @returns False if the trace is invalid or truncated, events up to that point are replayed.
+     */
+    bool replay(
+        ble::Gap::EventHandler &handler,
+        replay_mode_t mode = AS_FAST_AS_POSSIBLE,
+        mbed::Callback<void(uint32_t)> wait = nullptr
+    )
+    {
+        if (mode == ORIGINAL_TIMING && !wait) {
+            return false;
+        }
+
+        if (!read_header()) {
+            return false;
+        }
+
+        while (read_record()) {
+            if (mode == ORIGINAL_TIMING && _next_timestamp > _last_timestamp) {
+                wait(_next_timestamp - _last_timestamp);
+            }
+            handle_record(handler);
+        }
+
+        return !_truncated;
+    }
+
+    /**
+     * Start replaying the trace on the queue, one event per queue call.
+     *
+     * @param queue Queue the events are handled on, the one the handler posts to.
+     * @param handler Handler receiving the events.
+     * @param mode Replay speed.
+     * @param done Called on the queue at the end of the trace with false if it is invalid or
+     * truncated or the queue ran out of memory.
+     *
+     * @returns False if the trace header is invalid, done isn't called then.
+     */
+    bool start(
+        events::EventQueue &queue,
+        ble::Gap::EventHandler &handler,
+        replay_mode_t mode = AS_FAST_AS_POSSIBLE,
+        mbed::Callback<void(bool)> done = nullptr
+    )
+    {
+        if (!read_header()) {
+            return false;
+        }
+
+        _queue = &queue;
+        _handler = &handler;
+        _mode = mode;
+        _done = done;
+        post_next();
+        return true;
+    }
+
+    /** Number of records replayed by the last replay() or start(). */
+    uint32_t get_record_count() const
+    {
+        return _records;
+    }
+
+    /** Duration of the trace replayed by the last replay() or start() in milliseconds. */
+    uint32_t get_duration_ms() const
+    {
+        return _last_timestamp;
+    }
+
+private:
+    bool read_header()
+    {
+        uint8_t header[5];
+
+        _records = 0;
+        _last_timestamp = 0;
+        _truncated = false;
+
+        if (fread(header, sizeof(header), 1, _file) != 1 ||
+            header[0] != 'B' || header[1] != 'L' || header[2] != 'E' || header[3] != 'T' ||
+            header[4] != GAP_EVENT_TRACE_VERSION) {
+            printf("Invalid trace header\r\n");
+            return false;
+        }
+        return true;
+    }
+
+    /** Read the next record into the body, false at the end of the trace or if it's truncated. */
+    bool read_record()
+    {
+        uint8_t record[7];
+
+        if (fread(record, sizeof(record), 1, _file) != 1) {
+            return false;
+        }
+
+        _next_type = (gap_trace_record_t)record[0];
+        _next_timestamp = record[1] | (record[2] << 8) | (record[3] << 16) | ((uint32_t)record[4] << 24);
+        _size = record[5] | (record[6] << 8);
+        _offset = 0;
+
+        if (_size > sizeof(_body) || (_size && fread(_body, _size, 1, _file) != 1)) {
+            printf("Truncated trace\r\n");
+            _truncated = true;
+            return false;
+        }
+        return true;
+    }
+
+    void handle_record(ble::Gap::EventHandler &handler)
+    {
+        _last_timestamp = _next_timestamp;
+        dispatch(handler, _next_type);
+        _records++;
+    }
+
+    void post_next()
+    {
+        if (!read_record()) {
+            finish(!_truncated);
+            return;
+        }
+
+        int delay = 0;
+        if (_mode == ORIGINAL_TIMING && _next_timestamp > _last_timestamp) {
+            delay = _next_timestamp - _last_timestamp;
+        }
+
+        if (!_queue->call_in(std::chrono::milliseconds(delay), [this]() { on_record(); })) {
+            finish(false);
+        }
+    }
+
+    void on_record()
+    {
+        handle_record(*_handler);
+        post_next();
+    }
+
+    void finish(bool success)
+    {
+        if (_done) {
+            _done(success);
+        }
+    }
+
+    void dispatch(ble::Gap::EventHandler &handler, gap_trace_record_t type)
+    {
+        switch (type) {
+            case GAP_TRACE_ADVERTISING_REPORT: {
+                uint8_t type_bits = get_u8();
+                ble::peer_address_type_t peer_address_type = get_peer_address_type();
+                ble::address_t peer_address = get_address();
+                ble::phy_t primary_phy = get_phy();
+                ble::phy_t secondary_phy = get_phy();
+                ble::advertising_sid_t sid = get_u8();
+                ble::advertising_power_t tx_power = (int8_t)get_u8();
+                ble::rssi_t rssi = (int8_t)get_u8();
+                uint16_t periodic_interval = get_u16();
+                ble::peer_address_type_t direct_address_type = get_peer_address_type();
+                ble::address_t direct_address = get_address();
+
+                ble::AdvertisingReportEvent event(
+                    advertising_event_from_bits(type_bits),
+                    peer_address_type,
+                    peer_address,
+                    primary_phy,
+                    secondary_phy,
+                    sid,
+                    tx_power,
+                    rssi,
+                    periodic_interval,
+                    direct_address_type,
+                    direct_address,
+                    mbed::make_const_Span(_body + _offset, _size - _offset)
+                );
+                handler.onAdvertisingReport(event);
+                break;
+            }
+            case GAP_TRACE_CONNECTION_COMPLETE: {
+                ble_error_t status = (ble_error_t)get_u16();
+                ble::connection_handle_t connection = get_u16();
+                ble::connection_role_t role = (ble::connection_role_t::type)get_u8();
+                ble::peer_address_type_t peer_address_type = get_peer_address_type();
+                ble::address_t peer_address = get_address();
+                ble::address_t local_rpa = get_address();
+                ble::address_t peer_rpa = get_address();
+                uint16_t interval = get_u16();
+                uint16_t latency = get_u16();
+                uint16_t timeout = get_u16();
+
+                ble::ConnectionCompleteEvent event(
+                    status,
+                    connection,
+                    role,
+                    peer_address_type,
+                    peer_address,
+                    local_rpa,
+                    peer_rpa,
+                    ble::conn_interval_t(interval),
+                    latency,
+                    ble::supervision_timeout_t(timeout),
+                    0
+                );
+                handler.onConnectionComplete(event);
+                break;
+            }
+            case GAP_TRACE_DISCONNECTION_COMPLETE: {
+                ble::connection_handle_t connection = get_u16();
+                ble::disconnection_reason_t reason = (ble::disconnection_reason_t::type)get_u8();
+
+                handler.onDisconnectionComplete(ble::DisconnectionCompleteEvent(connection, reason));
+                break;
+            }
+            case GAP_TRACE_SCAN_TIMEOUT:
+                handler.onScanTimeout(ble::ScanTimeoutEvent());
+                break;
+            case GAP_TRACE_ADVERTISING_END: {
+                ble::advertising_handle_t adv_handle = get_u8();
+                ble::connection_handle_t connection = get_u16();
+                uint8_t completed_events = get_u8();
+                bool connected = get_u8();
+
+                handler.onAdvertisingEnd(
+                    ble::AdvertisingEndEvent(adv_handle, connection, completed_events, connected)
+                );
+                break;
+            }
+            default:
+                /* unknown records are skipped */
+                break;
+        }
+    }
+
+    uint8_t get_u8()
+    {
+        return _offset < _size ? _body[_offset++] : 0;
+    }
+
+    uint16_t get_u16()
+    {
+        uint16_t value = get_u8();
+        return value | (get_u8() << 8);
+    }
+
+    ble::address_t get_address()
+    {
+        uint8_t bytes[6];
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            bytes[i] = get_u8();
+        }
+        return ble::address_t(bytes);
+    }
+
+    ble::peer_address_type_t get_peer_address_type()
+    {
+        return (ble::peer_address_type_t::type)get_u8();
+    }
+
+    ble::phy_t get_phy()
+    {
+        return (ble::phy_t::type)get_u8();
+    }
+
+private:
+    FILE *_file;
+
+    uint8_t _body[GAP_EVENT_TRACE_MAX_BODY_SIZE];
+    size_t _size = 0;
+    size_t _offset = 0;
+
+    gap_trace_record_t _next_type = GAP_TRACE_ADVERTISING_REPORT;
+    uint32_t _next_timestamp = 0;
+    bool _truncated = false;
+
+    events::EventQueue *_queue = nullptr;
+    ble::Gap::EventHandler *_handler = nullptr;
+    replay_mode_t _mode = AS_FAST_AS_POSSIBLE;
+    mbed::Callback<void(bool)> _done;
+
+    uint32_t _records = 0;
+    uint32_t _last_timestamp = 0;
+};
+
+#endif /* GAP_EVENT_TRACE_H_ */
@@ -0,0 +1,764 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GATT_CENTRAL_PROCESS_H_
+#define GATT_CENTRAL_PROCESS_H_
+
+#include "ble_process.h"
+#include "scan_scheduler.h"
+#include "connection_attempts.h"
+#include "ble/GattClient.h"
+
+/* default number of peers, see GattCentralProcess */
+static const size_t MAX_CENTRAL_PEERS = 8;
+static const size_t MAX_CENTRAL_PEER_FILTERS = 8;
+static const size_t MAX_POLLED_ATTRIBUTES = 4;
+
+/**
+ * GattClient wrapper that keeps connections to several peripherals and polls them.
+ *
+ * Peripherals are selected by name (add_peer_name()) or by address (add_peer_address()).
+ * We scan and connect until set_max_peers() peripherals are connected, at most MaxPeers. Use
+ * e.g. GattCentralProcess<32> for dozens of sensors, the controller must support as many
+ * connections. All connections share the same connection interval. It is a multiple of a frame
+ * holding one connection event slot per peer, so events of different peers don't collide, and is
+ * derived from the poll interval so peripherals only wake a few times per poll.
+ *
+ * Once connected, the subscriptions (add_subscription()) are written to each peer, then the
+ * reads (add_read()) are polled every poll interval. Peers are served round-robin, one
+ * operation per peer per pass, with a bound on the number of operations in flight, so a slow
+ * peer can't starve the others. Read values and notifications are passed to the data handler.
+ *
+ * Poll latency (time to read all attributes of a peer) and staleness (time between two
+ * complete polls of a peer) are tracked per peer.
+ *
+ * A connection attempt is cancelled if it doesn't complete in time and the peer is then skipped
+ * for a backoff period, so a peripheral that went away doesn't hold up connecting to the others.
+ */
+template<size_t MaxPeers = MAX_CENTRAL_PEERS>
+class GattCentralProcess : public BLEProcess
+{
+public:
+    /** Statistics of a connected peer. Times are in milliseconds. */
+    struct peer_stats_t {
+        uint32_t polls = 0;
+        uint32_t failures = 0;
+        uint32_t last_latency_ms = 0;
+        uint32_t max_latency_ms = 0;
+        uint32_t avg_latency_ms = 0;
+        uint32_t max_staleness_ms = 0;
+    };
+
+    typedef mbed::Callback<void(
+        ble::connection_handle_t connection,
+        GattAttribute::Handle_t handle,
+        mbed::Span<const uint8_t> value
+    )> data_handler_t;
+
+    GattCentralProcess(events::EventQueue &event_queue, BLE &ble_interface) :
+        BLEProcess(event_queue, ble_interface)
+    {
+    }
+
+    /** Name we advertise as */
+    const char* get_device_name() override
+    {
+        static const char name[] = "GattCentral";
+        return name;
+    }
+
+    /** Connect to peripherals advertising this name. The string must outlive the process. */
+    bool add_peer_name(const char *name)
+    {
+        if (!name || _name_count == MAX_CENTRAL_PEER_FILTERS) {
+            return false;
+        }
+        _names[_name_count++] = name;
+        return true;
+    }
+
+    /** Connect to the peripheral with this address. */
+    bool add_peer_address(ble::peer_address_type_t type, const ble::address_t &address)
+    {
+        if (_address_count == MAX_CENTRAL_PEER_FILTERS) {
+            return false;
+        }
+        _address_types[_address_count] = type;
+        _addresses[_address_count] = address;
+        _address_count++;
+        return true;
+    }
+
+    /** Number of peripherals we keep connected, at most MaxPeers. */
+    void set_max_peers(size_t max_peers)
+    {
+        _max_peers = max_peers > MaxPeers ? MaxPeers : max_peers;
+        restart_scheduler();
+        update_connection_parameters();
+    }
+
+    /** Read the value of this attribute on every peer each poll interval. */
+    bool add_read(GattAttribute::Handle_t value_handle)
+    {
+        if (_read_count == MAX_POLLED_ATTRIBUTES) {
+            return false;
+        }
+        _reads[_read_count++] = value_handle;
+        return true;
+    }
+
+    /** Enable notifications by writing this CCCD on every peer after connecting. */
+    bool add_subscription(GattAttribute::Handle_t cccd_handle)
+    {
+        if (_subscription_count == MAX_POLLED_ATTRIBUTES) {
+            return false;
+        }
+        _subscriptions[_subscription_count++] = cccd_handle;
+        return true;
+    }
+
+    /** Time between the start of two polls of the same peer. */
+    void set_poll_interval(ble::millisecond_t interval)
+    {
+        _poll_interval_ms = interval.value();
+        restart_scheduler();
+        update_connection_parameters();
+    }
+
+    /** Maximum number of GATT operations in flight across all peers. */
+    void set_max_operations_in_flight(size_t max_in_flight)
+    {
+        _max_in_flight = max_in_flight ? max_in_flight : 1;
+    }
+
+    /** Set the callback receiving read values and notifications. */
+    void set_data_handler(data_handler_t handler)
+    {
+        _data_handler = handler;
+    }
+
+    /** Statistics of the peer using this connection or nullptr if not connected. */
+    const peer_stats_t* get_peer_stats(ble::connection_handle_t connection) const
+    {
+        for (size_t i = 0; i < MaxPeers; i++) {
+            if (_peers[i].connected && _peers[i].connection == connection) {
+                return &_peers[i].stats;
+            }
+        }
+        return nullptr;
+    }
+
+    /** Print statistics of all connected peers. */
+    void print_stats() const
+    {
+        for (size_t i = 0; i < MaxPeers; i++) {
+            const peer_t &peer = _peers[i];
+            if (!peer.connected) {
+                continue;
+            }
+            printf("Peer %u: %lu polls, %lu failures, latency last %lums avg %lums max %lums, "
+                   "max staleness %lums\r\n",
+                   (unsigned)i,
+                   (unsigned long)peer.stats.polls,
+                   (unsigned long)peer.stats.failures,
+                   (unsigned long)peer.stats.last_latency_ms,
+                   (unsigned long)peer.stats.avg_latency_ms,
+                   (unsigned long)peer.stats.max_latency_ms,
+                   (unsigned long)peer.stats.max_staleness_ms);
+        }
+        _connect_attempts.print_stats();
+    }
+
+    /** Access the scheduler picking scan parameters. Only use it from the event queue. */
+    ScanScheduler& get_scan_scheduler()
+    {
+        return _scan_scheduler;
+    }
+
+    /** Access the timeout and backoff of connection attempts. Only use it from the event queue. */
+    ConnectionAttempts& get_connection_attempts()
+    {
+        return _connect_attempts;
+    }
+
+private:
+    struct peer_t {
+        bool connected = false;
+        bool busy = false;
+        bool polling = false;
+        ble::connection_handle_t connection = 0;
+        ble::address_t address;
+        /* index of the next subscription to write, then of the next read */
+        size_t next_subscription = 0;
+        size_t next_read = 0;
+        uint32_t poll_start_tick = 0;
+        uint32_t last_poll_end_tick = 0;
+        peer_stats_t stats;
+    };
+
+    /** Scan until enough peers are connected and run the poll scheduler. */
+    void start_activity() override
+    {
+        if (!_gatt_client_registered) {
+            GattClient &client = _ble.gattClient();
+            client.onDataRead(makeFunctionPointer(this, &GattCentralProcess::on_data_read));
+            client.onDataWritten(makeFunctionPointer(this, &GattCentralProcess::on_data_written));
+            client.onHVX(makeFunctionPointer(this, &GattCentralProcess::on_hvx));
+            _gatt_client_registered = true;
+        }
+
+        if (!_scheduler_id) {
+            start_scheduler();
+        }
+
+        _event_queue.call([this]() { start_scanning(); });
+    }
+
+    /** Run the poll scheduler so each peer gets a tick per poll interval. */
+    void start_scheduler()
+    {
+        uint32_t tick_ms = _poll_interval_ms / (_max_peers ? _max_peers : 1);
+        if (tick_ms < 10) {
+            tick_ms = 10;
+        }
+        _scheduler_id = _event_queue.call_every(
+            std::chrono::milliseconds(tick_ms), [this]() { run_scheduler(); }
+        );
+    }
+
+    /** Apply a new poll interval or peer count to a running scheduler. */
+    void restart_scheduler()
+    {
+        if (!_scheduler_id) {
+            /* applied when the scheduler starts */
+            return;
+        }
+        _event_queue.cancel(_scheduler_id);
+        start_scheduler();
+    }
+
+    size_t connected_peers() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < MaxPeers; i++) {
+            if (_peers[i].connected) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /** Scan for missing peers */
+    void start_scanning()
+    {
+        if (_is_scanning || _connect_attempts.in_progress() || connected_peers() >= _max_peers) {
+            return;
+        }
+
+        const bool coded_supported = _gap.isFeatureSupported(
+            ble::controller_supported_features_t::LE_CODED_PHY
+        );
+        const ScanProfile &profile = _scan_scheduler.current_profile();
+
+        ble::ScanParameters scan_params;
+        _scan_scheduler.configure(scan_params, coded_supported);
+        ble_error_t ret = _gap.setScanParameters(scan_params);
+
+        if (ret) {
+            print_error(ret, "Gap::setScanParameters() failed\r\n");
+            return;
+        }
+
+        ret = _gap.startScan(profile.duration);
+        if (ret == ble_error_t::BLE_ERROR_NONE) {
+            _is_scanning = true;
+            _scan_scheduler.on_scan_started(_event_queue.tick(), profile.coded_phy && coded_supported);
+            printf("Started scanning for peers (%u/%u connected)\r\n",
+                   (unsigned)connected_peers(), (unsigned)_max_peers);
+        } else {
+            printf("Starting scan failed\r\n");
+        }
+    }
+
+    /** Restarts scanning after the idle period of the scan profile */
+    void onScanTimeout(const ble::ScanTimeoutEvent &event) override {
+        _is_scanning = false;
+        uint32_t idle_ms = _scan_scheduler.on_scan_stopped(_event_queue.tick());
+        _event_queue.call_in(std::chrono::milliseconds(idle_ms), [this]() { start_scanning(); });
+    }
+
+    bool is_connected_to(const ble::address_t &address) const
+    {
+        for (size_t i = 0; i < MaxPeers; i++) {
+            if (_peers[i].connected && _peers[i].address == address) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Check whether the advertiser is one of the peripherals we want. */
+    bool is_wanted(const ble::AdvertisingReportEvent &event) const
+    {
+        for (size_t i = 0; i < _address_count; i++) {
+            if (_address_types[i] == event.getPeerAddressType() &&
+                _addresses[i] == event.getPeerAddress()) {
+                return true;
+            }
+        }
+
+        if (!_name_count) {
+            return false;
+        }
+
+        ble::AdvertisingDataParser adv_data(event.getPayload());
+
+        while (adv_data.hasNext()) {
+            ble::AdvertisingDataParser::element_t field = adv_data.next();
+
+            if (field.type != ble::adv_data_type_t::COMPLETE_LOCAL_NAME) {
+                continue;
+            }
+
+            for (size_t i = 0; i < _name_count; i++) {
+                if (field.value.size() == strlen(_names[i]) &&
+                    (memcmp(field.value.data(), _names[i], field.value.size()) == 0)) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * All peers share one connection interval, a multiple of a frame holding one connection event
+     * slot per peer. The controller places each connection in its own slot so their events don't
+     * collide. The interval is about CONNECTION_EVENTS_PER_POLL times shorter than the poll
+     * interval, so a poll completes in a few events and peripherals sleep in between.
+     */
+    ble::ConnectionParameters get_connection_parameters() const
+    {
+        ble::ConnectionParameters connection_params;
+        connection_params.setConnectionParameters(
+            ble::conn_interval_t(get_connection_interval()),
+            ble::conn_interval_t(get_connection_interval()),
+            0,
+            ble::supervision_timeout_t(ble::millisecond_t(get_supervision_timeout_ms())),
+            ble::phy_t::LE_1M,
+            ble::conn_event_length_t(SLOT * 2),
+            ble::conn_event_length_t(SLOT * 2)
+        );
+
+        return connection_params;
+    }
+
+    /** Connection interval in 1.25ms units. */
+    uint16_t get_connection_interval() const
+    {
+        /* one slot per peer, the interval can't be shorter than 7.5ms */
+        uint32_t frame = SLOT * (_max_peers ? _max_peers : 1);
+        if (frame < 6) {
+            frame = 6;
+        }
+
+        uint32_t target = _poll_interval_ms * 4 / 5 / CONNECTION_EVENTS_PER_POLL;
+        if (target > MAX_CONNECTION_INTERVAL) {
+            target = MAX_CONNECTION_INTERVAL;
+        }
+
+        uint32_t interval = target / frame * frame;
+        return interval > frame ? interval : frame;
+    }
+
+    /** Six connection intervals, at least 4s, the spec requires more than two. */
+    uint32_t get_supervision_timeout_ms() const
+    {
+        uint32_t timeout_ms = (uint32_t)get_connection_interval() * 5 / 4 * 6;
+        if (timeout_ms < 4000) {
+            timeout_ms = 4000;
+        }
+        return timeout_ms > 32000 ? 32000 : timeout_ms;
+    }
+
+    /** Apply the connection parameters to the connected peers after a change of settings. */
+    void update_connection_parameters()
+    {
+        if (!_ble.hasInitialized()) {
+            return;
+        }
+
+        const uint16_t interval = get_connection_interval();
+
+        for (size_t i = 0; i < MaxPeers; i++) {
+            if (!_peers[i].connected) {
+                continue;
+            }
+            ble_error_t error = _gap.updateConnectionParameters(
+                _peers[i].connection,
+                ble::conn_interval_t(interval),
+                ble::conn_interval_t(interval),
+                0,
+                ble::supervision_timeout_t(ble::millisecond_t(get_supervision_timeout_ms())),
+                ble::conn_event_length_t(SLOT * 2),
+                ble::conn_event_length_t(SLOT * 2)
+            );
+            if (error) {
+                print_error(error, "Error caused by Gap::updateConnectionParameters");
+            }
+        }
+    }
+
+    /** Connect to the first wanted peripheral we aren't connected to yet */
+    void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override {
+        /* don't bother with analysing scan result if we're already connecting */
+        if (_connect_attempts.in_progress() || !event.getType().connectable()) {
+            return;
+        }
+
+        if (is_connected_to(event.getPeerAddress()) || !is_wanted(event)) {
+            return;
+        }
+
+        /* a peer that failed recently waits for its backoff so others get a chance */
+        if (!_connect_attempts.may_connect(event.getPeerAddress(), _event_queue.tick())) {
+            return;
+        }
+
+        printf("Found peer ");
+        print_address(event.getPeerAddress());
+
+        _scan_scheduler.on_target_found();
+        _scan_scheduler.on_scan_stopped(_event_queue.tick());
+        _is_scanning = false;
+
+        ble_error_t error = _gap.stopScan();
+
+        if (error) {
+            print_error(error, "Error caused by Gap::stopScan");
+            return;
+        }
+
+        error = _gap.connect(
+            event.getPeerAddressType(),
+            event.getPeerAddress(),
+            get_connection_parameters()
+        );
+
+        /* we may have already scan events waiting
+         * to be processed so we need to remember
+         * that we are already connecting and ignore them */
+        _connect_attempts.seed(_gap);
+        _connect_attempts.start(event.getPeerAddress(), _event_queue.tick());
+
+        if (error) {
+            print_error(error, "Error caused by Gap::connect");
+            _connect_attempts.failed(_event_queue.tick());
+            start_scanning();
+            return;
+        }
+
+        const uint32_t attempt_id = _connect_attempts.get_attempt_id();
+        _connect_attempts.set_timeout_event(_event_queue.call_in(
+            std::chrono::milliseconds(_connect_attempts.get_timeout_ms()),
+            [this, attempt_id]() { on_connection_timeout(attempt_id); }
+        ));
+    }
+
+    /** Cancel the connection attempt if the peer didn't answer in time */
+    void on_connection_timeout(uint32_t attempt_id)
+    {
+        if (attempt_id != _connect_attempts.get_attempt_id()) {
+            return;
+        }
+
+        /* this event is running, there is nothing left to cancel */
+        _connect_attempts.take_timeout_event();
+
+        if (!_connect_attempts.has_timed_out(_event_queue.tick())) {
+            return;
+        }
+
+        printf("Connection attempt timed out\r\n");
+
+        ble_error_t error = _gap.cancelConnect();
+
+        if (error) {
+            print_error(error, "Error caused by Gap::cancelConnect");
+            /* we won't get a connection complete event, give up on the attempt */
+            _connect_attempts.failed(_event_queue.tick());
+            start_scanning();
+            return;
+        }
+
+        /* the connection complete event will report the failure */
+        _connect_attempts.cancelling();
+    }
+
+    /** Give the new connection a peer slot and resume scanning for the others */
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        if (event.getOwnRole() == ble::connection_role_t::CENTRAL) {
+            /* the attempt is over, don't hold event memory until the timeout expires */
+            int timeout_event = _connect_attempts.take_timeout_event();
+            if (timeout_event) {
+                _event_queue.cancel(timeout_event);
+            }
+            if (event.getStatus() == BLE_ERROR_NONE) {
+                _connect_attempts.succeeded();
+            } else {
+                _connect_attempts.failed(_event_queue.tick());
+            }
+        }
+
+        if (event.getStatus() == BLE_ERROR_NONE) {
+            for (size_t i = 0; i < MaxPeers; i++) {
+                if (!_peers[i].connected) {
+                    _peers[i] = peer_t();
+                    _peers[i].connected = true;
+                    _peers[i].connection = event.getConnectionHandle();
+                    _peers[i].address = event.getPeerAddress();
+                    _peers[i].last_poll_end_tick = _event_queue.tick();
+                    break;
+                }
+            }
+        }
+
+        BLEProcess::onConnectionComplete(event);
+
+        _event_queue.call([this]() { start_scanning(); });
+    }
+
+    /** Free the peer slot and scan for a replacement */
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
+    {
+        peer_t *peer = find_peer(event.getConnectionHandle());
+        if (peer) {
+            if (peer->busy) {
+                _in_flight--;
+            }
+            peer->connected = false;
+        }
+
+        /* bound the staleness: look for the dropped peer with the most aggressive profile */
+        if (_is_scanning) {
+            _gap.stopScan();
+            _scan_scheduler.on_scan_stopped(_event_queue.tick());
+            _is_scanning = false;
+        }
+        _scan_scheduler.expect_target();
+
+        BLEProcess::onDisconnectionComplete(event);
+    }
+
+    peer_t* find_peer(ble::connection_handle_t connection)
+    {
+        for (size_t i = 0; i < MaxPeers; i++) {
+            if (_peers[i].connected && _peers[i].connection == connection) {
+                return &_peers[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Serve peers round-robin: in each pass every idle peer with work gets at most one
+     * operation, until the in flight budget is used.
+     */
+    void run_scheduler()
+    {
+        const uint32_t now = _event_queue.tick();
+
+        for (size_t n = 0; n < MaxPeers && _in_flight < _max_in_flight; n++) {
+            size_t index = (_next_peer + n) % MaxPeers;
+            peer_t &peer = _peers[index];
+
+            if (!peer.connected || peer.busy) {
+                continue;
+            }
+
+            if (!peer.polling) {
+                if (peer.next_subscription == _subscription_count && !_read_count) {
+                    continue;
+                }
+                if (peer.next_subscription == _subscription_count &&
+                    (now - peer.poll_start_tick) < _poll_interval_ms && peer.stats.polls) {
+                    /* not due yet */
+                    continue;
+                }
+                peer.polling = true;
+                peer.next_read = 0;
+                peer.poll_start_tick = now;
+            }
+
+            if (issue_operation(peer)) {
+                _next_peer = (index + 1) % MaxPeers;
+            }
+        }
+    }
+
+    /** Send the next subscription or read of the peer. */
+    bool issue_operation(peer_t &peer)
+    {
+        ble_error_t error;
+        GattClient &client = _ble.gattClient();
+
+        if (peer.next_subscription < _subscription_count) {
+            static const uint8_t notify_enable[2] = { 0x01, 0x00 };
+            error = client.write(
+                GattClient::GATT_OP_WRITE_REQ,
+                peer.connection,
+                _subscriptions[peer.next_subscription],
+                sizeof(notify_enable),
+                notify_enable
+            );
+        } else if (peer.next_read < _read_count) {
+            error = client.read(peer.connection, _reads[peer.next_read], 0);
+        } else {
+            end_poll(peer, _event_queue.tick());
+            return false;
+        }
+
+        if (error) {
+            /* retry on the next pass */
+            peer.stats.failures++;
+            return false;
+        }
+
+        peer.busy = true;
+        _in_flight++;
+        return true;
+    }
+
+    /** Account for the completed operation of a peer and move to its next one. */
+    void complete_operation(peer_t &peer, bool success)
+    {
+        peer.busy = false;
+        _in_flight--;
+
+        if (!success) {
+            peer.stats.failures++;
+        }
+
+        if (peer.next_subscription < _subscription_count) {
+            peer.next_subscription++;
+        } else {
+            peer.next_read++;
+        }
+
+        if (peer.next_subscription == _subscription_count && peer.next_read >= _read_count) {
+            end_poll(peer, _event_queue.tick());
+        }
+
+        _event_queue.call([this]() { run_scheduler(); });
+    }
+
+    void end_poll(peer_t &peer, uint32_t now)
+    {
+        if (!peer.polling) {
+            return;
+        }
+        peer.polling = false;
+
+        if (!_read_count) {
+            /* only subscriptions, nothing to measure */
+            return;
+        }
+
+        peer_stats_t &stats = peer.stats;
+        uint32_t latency = now - peer.poll_start_tick;
+        uint32_t staleness = now - peer.last_poll_end_tick;
+
+        stats.last_latency_ms = latency;
+        if (latency > stats.max_latency_ms) {
+            stats.max_latency_ms = latency;
+        }
+        if (staleness > stats.max_staleness_ms) {
+            stats.max_staleness_ms = staleness;
+        }
+        /* moving average over the last 8 polls */
+        stats.avg_latency_ms = stats.polls ? (stats.avg_latency_ms * 7 + latency) / 8 : latency;
+        stats.polls++;
+
+        peer.last_poll_end_tick = now;
+    }
+
+    void on_data_read(const GattReadCallbackParams *params)
+    {
+        peer_t *peer = find_peer(params->connHandle);
+        if (!peer || !peer->busy) {
+            return;
+        }
+
+        bool success = params->status == BLE_ERROR_NONE;
+        if (success && _data_handler) {
+            _data_handler(params->connHandle, params->handle, mbed::make_const_Span(params->data, params->len));
+        }
+
+        complete_operation(*peer, success);
+    }
+
+    void on_data_written(const GattWriteCallbackParams *params)
+    {
+        peer_t *peer = find_peer(params->connHandle);
+        if (!peer || !peer->busy) {
+            return;
+        }
+
+        complete_operation(*peer, params->status == BLE_ERROR_NONE);
+    }
+
+    void on_hvx(const GattHVXCallbackParams *params)
+    {
+        if (_data_handler && find_peer(params->connHandle)) {
+            _data_handler(params->connHandle, params->handle, mbed::make_const_Span(params->data, params->len));
+        }
+    }
+
+private:
+    /* 3.75ms connection event slot of a peer in 1.25ms units */
+    static const uint16_t SLOT = 3;
+    /* 4s, the longest interval in 1.25ms units */
+    static const uint32_t MAX_CONNECTION_INTERVAL = 3200;
+    static const uint32_t CONNECTION_EVENTS_PER_POLL = 8;
+
+    const char *_names[MAX_CENTRAL_PEER_FILTERS];
+    size_t _name_count = 0;
+    ble::peer_address_type_t _address_types[MAX_CENTRAL_PEER_FILTERS];
+    ble::address_t _addresses[MAX_CENTRAL_PEER_FILTERS];
+    size_t _address_count = 0;
+
+    GattAttribute::Handle_t _reads[MAX_POLLED_ATTRIBUTES];
+    size_t _read_count = 0;
+    GattAttribute::Handle_t _subscriptions[MAX_POLLED_ATTRIBUTES];
+    size_t _subscription_count = 0;
+
+    peer_t _peers[MaxPeers];
+    size_t _max_peers = MaxPeers;
+    size_t _next_peer = 0;
+    size_t _in_flight = 0;
+    size_t _max_in_flight = 2;
+    uint32_t _poll_interval_ms = 1000;
+
+    data_handler_t _data_handler;
+    ScanScheduler _scan_scheduler;
+    int _scheduler_id = 0;
+    bool _gatt_client_registered = false;
+    bool _is_scanning = false;
+    ConnectionAttempts _connect_attempts;
+};
+
+#endif /* GATT_CENTRAL_PROCESS_H_ */
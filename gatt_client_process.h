@@ -18,6 +18,8 @@
 #define GATT_CLIENT_PROCESS_H_
 
 #include "ble_process.h"
+#include "scan_scheduler.h"
+#include "connection_attempts.h"
 
 using namespace std::literals::chrono_literals;
 
@@ -47,42 +49,119 @@ public:
         return name;
     }
 
+    /** Access the scheduler picking scan parameters. Only use it from the event queue. */
+    ScanScheduler& get_scan_scheduler()
+    {
+        return _scan_scheduler;
+    }
+
+    /** Access the timeout and backoff of connection attempts. Only use it from the event queue. */
+    ConnectionAttempts& get_connection_attempts()
+    {
+        return _connect_attempts;
+    }
+
 private:
-    /** Alternate between scanning and advertising */
+    /** Alternate between scanning and advertising, only advertise while the scan backs off */
     virtual void start_activity()
     {
         static bool scan = true;
+        if (scan && (int32_t)(_event_queue.tick() - _scan_resume_tick) < 0) {
+            /* the scan waits for the idle period of its profile to end, advertising doesn't */
+            _event_queue.call([this]() { start_advertising(); });
+            return;
+        }
         if (scan) {
             _event_queue.call([this]() { start_scanning(); });
         } else {
             _event_queue.call([this]() { start_advertising(); });
         }
         scan = !scan;
-        _is_connecting = false;
     }
 
     /** scan for GattServer */
     void start_scanning()
     {
+        const bool coded_supported = _gap.isFeatureSupported(
+            ble::controller_supported_features_t::LE_CODED_PHY
+        );
+        const ScanProfile &profile = _scan_scheduler.current_profile();
+
         ble::ScanParameters scan_params;
+        _scan_scheduler.configure(scan_params, coded_supported);
         _ble.gap().setScanParameters(scan_params);
-        ble_error_t ret = _ble.gap().startScan(ble::scan_duration_t(ble::millisecond_t(4000)));
+        ble_error_t ret = _ble.gap().startScan(profile.duration);
         if (ret == ble_error_t::BLE_ERROR_NONE) {
-            printf("Started scanning for \"%s\"\r\n", get_peer_device_name());
+            _scan_scheduler.on_scan_started(_event_queue.tick(), profile.coded_phy && coded_supported);
+            printf("Started scanning for \"%s\" (profile %u)\r\n",
+                   get_peer_device_name(), (unsigned)_scan_scheduler.current_level());
         } else {
             printf("Starting scan failed\r\n");
         }
     }
 
-    /** Restarts main activity */
+    /** Restarts main activity, the next scan waits for the idle period of the scan profile */
     void onScanTimeout(const ble::ScanTimeoutEvent &event) override {
+        uint32_t now = _event_queue.tick();
+        uint32_t idle_ms = _scan_scheduler.on_scan_stopped(now);
+        _scan_scheduler.print_stats(now);
+        _scan_resume_tick = now + idle_ms;
         start_activity();
     }
 
+    /** Track the outcome of our connection attempt before handing over to the process */
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        if (event.getOwnRole() == ble::connection_role_t::CENTRAL) {
+            /* the attempt is over, don't hold event memory until the timeout expires */
+            int timeout_event = _connect_attempts.take_timeout_event();
+            if (timeout_event) {
+                _event_queue.cancel(timeout_event);
+            }
+            if (event.getStatus() == BLE_ERROR_NONE) {
+                _connect_attempts.succeeded();
+            } else {
+                _connect_attempts.failed(_event_queue.tick());
+            }
+        }
+
+        BLEProcess::onConnectionComplete(event);
+    }
+
+    /** Cancel the connection attempt if the peer didn't answer in time */
+    void on_connection_timeout(uint32_t attempt_id)
+    {
+        if (attempt_id != _connect_attempts.get_attempt_id()) {
+            return;
+        }
+
+        /* this event is running, there is nothing left to cancel */
+        _connect_attempts.take_timeout_event();
+
+        if (!_connect_attempts.has_timed_out(_event_queue.tick())) {
+            return;
+        }
+
+        printf("Connection attempt timed out\r\n");
+
+        ble_error_t error = _ble.gap().cancelConnect();
+
+        if (error) {
+            print_error(error, "Error caused by Gap::cancelConnect");
+            /* we won't get a connection complete event, give up on the attempt */
+            _connect_attempts.failed(_event_queue.tick());
+            start_activity();
+            return;
+        }
+
+        /* the connection complete event will report the failure */
+        _connect_attempts.cancelling();
+    }
+
     /** Check advertising report for name and connect to any device with the name GattServer */
     void onAdvertisingReport(const ble::AdvertisingReportEvent &event) override {
         /* don't bother with analysing scan result if we're already connecting */
-        if (_is_connecting) {
+        if (_connect_attempts.in_progress()) {
             return;
         }
 
@@ -102,8 +181,16 @@ private:
                 if (field.value.size() == strlen(get_peer_device_name()) &&
                     (memcmp(field.value.data(), get_peer_device_name(), field.value.size()) == 0)) {
 
+                    if (!_connect_attempts.may_connect(event.getPeerAddress(), _event_queue.tick())) {
+                        /* the peer failed recently, keep scanning until its backoff ends */
+                        return;
+                    }
+
                     printf("We found \"%s\", connecting...\r\n", get_peer_device_name());
 
+                    _scan_scheduler.on_target_found();
+                    _scan_scheduler.on_scan_stopped(_event_queue.tick());
+
                     ble_error_t error = _ble.gap().stopScan();
 
                     if (error) {
@@ -119,15 +206,24 @@ private:
                         connection_params
                     );
 
+                    /* we may have already scan events waiting
+                     * to be processed so we need to remember
+                     * that we are already connecting and ignore them */
+                    _connect_attempts.seed(_gap);
+                    _connect_attempts.start(event.getPeerAddress(), _event_queue.tick());
+
                     if (error) {
-                        _ble.gap().startScan();
+                        print_error(error, "Error caused by Gap::connect");
+                        _connect_attempts.failed(_event_queue.tick());
+                        start_scanning();
                         return;
                     }
 
-                    /* we may have already scan events waiting
-                     * to be processed so we need to remember
-                     * that we are already connecting and ignore them */
-                    _is_connecting = true;
+                    const uint32_t attempt_id = _connect_attempts.get_attempt_id();
+                    _connect_attempts.set_timeout_event(_event_queue.call_in(
+                        std::chrono::milliseconds(_connect_attempts.get_timeout_ms()),
+                        [this, attempt_id]() { on_connection_timeout(attempt_id); }
+                    ));
 
                     return;
                 }
@@ -135,7 +231,9 @@ private:
         }
     }
 private:
-    bool _is_connecting = false;
+    ConnectionAttempts _connect_attempts;
+    ScanScheduler _scan_scheduler;
+    uint32_t _scan_resume_tick = 0;
 };
 
 #endif /* GATT_CLIENT_PROCESS_H_ */
@@ -0,0 +1,410 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LINK_TELEMETRY_H_
+#define LINK_TELEMETRY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pretty_printer.h"
+#include "gap_event_dispatcher.h"
+#include "ble/BLE.h"
+#include "events/mbed_events.h"
+#include "platform/Callback.h"
+#include "platform/NonCopyable.h"
+
+/* as many connections as a GattCentralProcess holds by default */
+static const size_t MAX_TELEMETRY_CONNECTIONS = 8;
+static const size_t LINK_TELEMETRY_RING_SIZE = 16;
+
+/** Fixed size ring buffer keeping the latest entries. */
+template<typename T, size_t Size>
+class TelemetryRing
+{
+public:
+    void push(const T &entry)
+    {
+        _entries[_next] = entry;
+        _next = (_next + 1) % Size;
+        if (_count < Size) {
+            _count++;
+        }
+    }
+
+    void clear()
+    {
+        _next = 0;
+        _count = 0;
+    }
+
+    size_t size() const
+    {
+        return _count;
+    }
+
+    /** Entry at index, 0 being the oldest. */
+    const T& operator[](size_t index) const
+    {
+        return _entries[(_next + Size - _count + index) % Size];
+    }
+
+    /** Copy up to max entries, oldest first. */
+    size_t copy(T *out, size_t max) const
+    {
+        size_t count = max < _count ? max : _count;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = (*this)[_count - count + i];
+        }
+        return count;
+    }
+
+private:
+    T _entries[Size];
+    size_t _next = 0;
+    size_t _count = 0;
+};
+
+/** RSSI sample. */
+struct rssi_sample_t {
+    uint32_t tick = 0;
+    ble::rssi_t rssi = 0;
+};
+
+/** Change of the state of a link. */
+struct link_event_t {
+    enum type_t : uint8_t {
+        CONNECTED,
+        PARAMETERS_UPDATED,
+        PHY_UPDATED,
+        DISCONNECTED
+    };
+
+    uint32_t tick = 0;
+    type_t type = CONNECTED;
+    /* CONNECTED and PARAMETERS_UPDATED: interval, latency, supervision timeout
+     * PHY_UPDATED: tx phy, rx phy
+     * DISCONNECTED: reason */
+    uint16_t values[3] = { 0 };
+};
+
+/** Telemetry of one connection. Ticks are EventQueue::tick() values in milliseconds. */
+struct link_telemetry_t {
+    bool used = false;
+    bool connected = false;
+    ble::connection_handle_t connection = 0;
+    ble::address_t peer_address;
+    uint32_t connected_tick = 0;
+    uint32_t disconnected_tick = 0;
+    ble::phy_t tx_phy = ble::phy_t::LE_1M;
+    ble::phy_t rx_phy = ble::phy_t::LE_1M;
+    uint16_t interval = 0;
+    uint16_t latency = 0;
+    uint16_t supervision_timeout = 0;
+    uint8_t disconnection_reason = 0;
+    TelemetryRing<rssi_sample_t, LINK_TELEMETRY_RING_SIZE> rssi;
+    TelemetryRing<link_event_t, LINK_TELEMETRY_RING_SIZE> events;
+};
+
+/**
+ * Opt-in link quality telemetry of the connections.
+ *
+ * Attach it with BLEApp::add_gap_event_handler(&telemetry, LinkTelemetry::EVENT_MASK). It keeps
+ * a fixed size block per connection: current PHY and connection parameters, uptime, the last
+ * disconnection reason and ring buffers of RSSI samples and link events. The block of a closed
+ * connection stays readable until a new connection needs the slot. When all slots hold open
+ * connections, new connections aren't tracked and are counted by get_refused_count().
+ *
+ * Gap has no API to read the RSSI of a connection, sampling RSSI requires a sampler callback
+ * (e.g. using a vendor HCI command). Without it no RSSI is sampled and nothing is scheduled.
+ * Only use it from the event queue.
+ */
+class LinkTelemetry : private mbed::NonCopyable<LinkTelemetry>, public ble::Gap::EventHandler
+{
+public:
+    static const uint32_t EVENT_MASK =
+        GAP_EVENT_CONNECTION_COMPLETE |
+        GAP_EVENT_CONNECTION_PARAMETERS_UPDATE_COMPLETE |
+        GAP_EVENT_READ_PHY |
+        GAP_EVENT_PHY_UPDATE_COMPLETE |
+        GAP_EVENT_DISCONNECTION_COMPLETE;
+
+    typedef mbed::Callback<bool(ble::connection_handle_t connection, ble::rssi_t &rssi)> rssi_sampler_t;
+
+    LinkTelemetry(BLE &ble, events::EventQueue &event_queue) :
+        _ble(ble),
+        _event_queue(event_queue)
+    {
+    }
+
+    ~LinkTelemetry()
+    {
+        stop_sampling();
+    }
+
+    /**
+     * Sample the RSSI of all connections at the given interval.
+     *
+     * @param sampler Reads the RSSI of a connection, returns false if it couldn't.
+     */
+    void start_sampling(ble::millisecond_t interval, rssi_sampler_t sampler)
+    {
+        stop_sampling();
+        _sampler = sampler;
+        if (_sampler && interval.value()) {
+            _sampling_id = _event_queue.call_every(
+                std::chrono::milliseconds(interval.value()), [this]() { sample(); }
+            );
+        }
+    }
+
+    void stop_sampling()
+    {
+        if (_sampling_id) {
+            _event_queue.cancel(_sampling_id);
+            _sampling_id = 0;
+        }
+    }
+
+    /** Telemetry of a connection, open or recently closed, or nullptr if unknown. */
+    const link_telemetry_t* get(ble::connection_handle_t connection) const
+    {
+        const link_telemetry_t *found = nullptr;
+        for (size_t i = 0; i < MAX_TELEMETRY_CONNECTIONS; i++) {
+            if (_links[i].used && _links[i].connection == connection) {
+                /* handles are reused, prefer the open connection */
+                if (_links[i].connected) {
+                    return &_links[i];
+                }
+                found = &_links[i];
+            }
+        }
+        return found;
+    }
+
+    /** Connections not tracked because all slots held open connections. */
+    uint32_t get_refused_count() const
+    {
+        return _refused;
+    }
+
+    /** Time the connection has been up, or was up if closed, in milliseconds. */
+    uint32_t get_uptime_ms(const link_telemetry_t &link) const
+    {
+        uint32_t end = link.connected ? _event_queue.tick() : link.disconnected_tick;
+        return end - link.connected_tick;
+    }
+
+    /** Print the telemetry of all known connections. */
+    void print() const
+    {
+        for (size_t i = 0; i < MAX_TELEMETRY_CONNECTIONS; i++) {
+            const link_telemetry_t &link = _links[i];
+            if (!link.used) {
+                continue;
+            }
+
+            printf("Connection %u %s, up %lums, %s/%s, interval %u latency %u",
+                   link.connection, link.connected ? "open" : "closed",
+                   (unsigned long)get_uptime_ms(link),
+                   phy_to_string(link.tx_phy), phy_to_string(link.rx_phy),
+                   link.interval, link.latency);
+            if (link.rssi.size()) {
+                printf(", rssi %d", link.rssi[link.rssi.size() - 1].rssi);
+            }
+            if (!link.connected) {
+                printf(", reason 0x%02x", link.disconnection_reason);
+            }
+            printf("\r\n");
+        }
+        if (_refused) {
+            printf("Connections not tracked: %lu\r\n", (unsigned long)_refused);
+        }
+    }
+
+    void onConnectionComplete(const ble::ConnectionCompleteEvent &event) override
+    {
+        if (event.getStatus() != BLE_ERROR_NONE) {
+            return;
+        }
+
+        link_telemetry_t *link = allocate();
+        if (!link) {
+            _refused++;
+            return;
+        }
+
+        link->used = true;
+        link->connected = true;
+        link->connection = event.getConnectionHandle();
+        link->peer_address = event.getPeerAddress();
+        link->connected_tick = _event_queue.tick();
+        link->tx_phy = ble::phy_t::LE_1M;
+        link->rx_phy = ble::phy_t::LE_1M;
+        link->interval = event.getConnectionInterval().value();
+        link->latency = event.getConnectionLatency().value();
+        link->supervision_timeout = event.getSupervisionTimeout().value();
+        link->rssi.clear();
+        link->events.clear();
+
+        push_event(*link, link_event_t::CONNECTED, link->interval, link->latency, link->supervision_timeout);
+
+        /* the connection may have been established on another PHY */
+        _ble.gap().readPhy(link->connection);
+    }
+
+    void onConnectionParametersUpdateComplete(
+        const ble::ConnectionParametersUpdateCompleteEvent &event
+    ) override
+    {
+        link_telemetry_t *link = find_open(event.getConnectionHandle());
+        if (!link || event.getStatus() != BLE_ERROR_NONE) {
+            return;
+        }
+
+        link->interval = event.getConnectionInterval().value();
+        link->latency = event.getPeripheralLatency().value();
+        link->supervision_timeout = event.getSupervisionTimeout().value();
+
+        push_event(*link, link_event_t::PARAMETERS_UPDATED, link->interval, link->latency, link->supervision_timeout);
+    }
+
+    void onReadPhy(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        update_phy(status, connectionHandle, txPhy, rxPhy);
+    }
+
+    void onPhyUpdateComplete(
+        ble_error_t status,
+        ble::connection_handle_t connectionHandle,
+        ble::phy_t txPhy,
+        ble::phy_t rxPhy
+    ) override
+    {
+        update_phy(status, connectionHandle, txPhy, rxPhy);
+    }
+
+    void onDisconnectionComplete(const ble::DisconnectionCompleteEvent &event) override
+    {
+        link_telemetry_t *link = find_open(event.getConnectionHandle());
+        if (!link) {
+            return;
+        }
+
+        link->connected = false;
+        link->disconnected_tick = _event_queue.tick();
+        link->disconnection_reason = event.getReason().value();
+
+        push_event(*link, link_event_t::DISCONNECTED, link->disconnection_reason);
+    }
+
+private:
+    /** Free slot or the one of the connection closed the longest time ago, nullptr if all are open. */
+    link_telemetry_t* allocate()
+    {
+        link_telemetry_t *oldest = nullptr;
+        for (size_t i = 0; i < MAX_TELEMETRY_CONNECTIONS; i++) {
+            if (!_links[i].used) {
+                return &_links[i];
+            }
+            if (!_links[i].connected &&
+                (!oldest || (int32_t)(_links[i].disconnected_tick - oldest->disconnected_tick) < 0)) {
+                oldest = &_links[i];
+            }
+        }
+        /* open connections are never recycled */
+        return oldest;
+    }
+
+    link_telemetry_t* find_open(ble::connection_handle_t connection)
+    {
+        for (size_t i = 0; i < MAX_TELEMETRY_CONNECTIONS; i++) {
+            if (_links[i].used && _links[i].connected && _links[i].connection == connection) {
+                return &_links[i];
+            }
+        }
+        return nullptr;
+    }
+
+    void update_phy(
+        ble_error_t status,
+        ble::connection_handle_t connection,
+        ble::phy_t tx_phy,
+        ble::phy_t rx_phy
+    )
+    {
+        link_telemetry_t *link = find_open(connection);
+        if (!link || status != BLE_ERROR_NONE) {
+            return;
+        }
+
+        if (link->tx_phy == tx_phy && link->rx_phy == rx_phy) {
+            return;
+        }
+
+        link->tx_phy = tx_phy;
+        link->rx_phy = rx_phy;
+        push_event(*link, link_event_t::PHY_UPDATED, tx_phy.value(), rx_phy.value());
+    }
+
+    void push_event(
+        link_telemetry_t &link,
+        link_event_t::type_t type,
+        uint16_t value0 = 0,
+        uint16_t value1 = 0,
+        uint16_t value2 = 0
+    )
+    {
+        link_event_t event;
+        event.tick = _event_queue.tick();
+        event.type = type;
+        event.values[0] = value0;
+        event.values[1] = value1;
+        event.values[2] = value2;
+        link.events.push(event);
+    }
+
+    void sample()
+    {
+        for (size_t i = 0; i < MAX_TELEMETRY_CONNECTIONS; i++) {
+            link_telemetry_t &link = _links[i];
+            if (!link.used || !link.connected) {
+                continue;
+            }
+
+            rssi_sample_t sample;
+            if (_sampler(link.connection, sample.rssi)) {
+                sample.tick = _event_queue.tick();
+                link.rssi.push(sample);
+            }
+        }
+    }
+
+private:
+    BLE &_ble;
+    events::EventQueue &_event_queue;
+
+    link_telemetry_t _links[MAX_TELEMETRY_CONNECTIONS];
+    rssi_sampler_t _sampler;
+    int _sampling_id = 0;
+    uint32_t _refused = 0;
+};
+
+#endif /* LINK_TELEMETRY_H_ */
@@ -102,4 +102,216 @@ inline const char* phy_to_string(ble::phy_t phy) {
     }
 }
 
+/**
+ * Calls of the BLE API whose results are counted by BleCounters. There is one site per call in
+ * the code, so a failure points to the code that made it even when several use the same API.
+ */
+enum ble_call_site_t : uint8_t {
+    BLE_CALL_INIT,
+    /* start_advertising() */
+    BLE_CALL_SET_ADVERTISING_PARAMETERS,
+    BLE_CALL_SET_ADVERTISING_PAYLOAD,
+    BLE_CALL_START_ADVERTISING,
+    /* update_advertising_payloads() */
+    BLE_CALL_UPDATE_ADVERTISING_PAYLOAD,
+    /* advertising set of start_periodic_advertising() */
+    BLE_CALL_PERIODIC_CREATE_ADVERTISING_SET,
+    BLE_CALL_PERIODIC_SET_ADVERTISING_PAYLOAD,
+    BLE_CALL_PERIODIC_START_ADVERTISING,
+    /* periodic train of start_periodic_advertising() and update_periodic_advertising_data() */
+    BLE_CALL_SET_PERIODIC_ADVERTISING_PARAMETERS,
+    BLE_CALL_SET_PERIODIC_ADVERTISING_PAYLOAD,
+    BLE_CALL_START_PERIODIC_ADVERTISING,
+    BLE_CALL_SET_SCAN_PARAMETERS,
+    BLE_CALL_START_SCAN,
+    BLE_CALL_STOP_SCAN,
+    BLE_CALL_CONNECT,
+    BLE_CALL_CANCEL_CONNECT,
+    BLE_CALL_CREATE_SYNC,
+    BLE_CALL_SITE_COUNT
+};
+
+/** Events counted by BleCounters. */
+enum ble_app_event_t : uint8_t {
+    BLE_EVENT_ADVERTISING_STARTED,
+    BLE_EVENT_SCAN_STARTED,
+    BLE_EVENT_CONNECTED,
+    BLE_EVENT_CONNECTION_FAILED,
+    BLE_EVENT_DISCONNECTED,
+    BLE_EVENT_COUNT
+};
+
+/** Number of ble_error_t values counted separately, the last one counts all others. */
+static const size_t BLE_ERROR_COUNTER_COUNT = 15;
+
+/** Index of the error in the counters of a call site, 0 being BLE_ERROR_NONE. */
+inline uint8_t ble_error_index(ble_error_t error)
+{
+    switch(error) {
+        case BLE_ERROR_NONE: return 0;
+        case BLE_ERROR_BUFFER_OVERFLOW: return 1;
+        case BLE_ERROR_NOT_IMPLEMENTED: return 2;
+        case BLE_ERROR_PARAM_OUT_OF_RANGE: return 3;
+        case BLE_ERROR_INVALID_PARAM: return 4;
+        case BLE_STACK_BUSY: return 5;
+        case BLE_ERROR_INVALID_STATE: return 6;
+        case BLE_ERROR_NO_MEM: return 7;
+        case BLE_ERROR_OPERATION_NOT_PERMITTED: return 8;
+        case BLE_ERROR_INITIALIZATION_INCOMPLETE: return 9;
+        case BLE_ERROR_ALREADY_INITIALIZED: return 10;
+        case BLE_ERROR_UNSPECIFIED: return 11;
+        case BLE_ERROR_INTERNAL_STACK_FAILURE: return 12;
+        case BLE_ERROR_NOT_FOUND: return 13;
+        default: return BLE_ERROR_COUNTER_COUNT - 1;
+    }
+}
+
+/**
+ * Fixed memory counters of the results of BLE calls, per call site and error, and of app events.
+ *
+ * Counters are 32 bits and wrap, compare two snapshots modulo 2^32 to get the counts between
+ * them. Update and read them from the event queue; use snapshot() to get a consistent copy and
+ * serialize() to send it somewhere.
+ */
+class BleCounters
+{
+public:
+    struct snapshot_t {
+        /* calls per site and result, index 0 counts the successful calls */
+        uint32_t calls[BLE_CALL_SITE_COUNT][BLE_ERROR_COUNTER_COUNT];
+        uint32_t events[BLE_EVENT_COUNT];
+    };
+
+    static const uint8_t SERIALIZATION_VERSION = 3;
+
+    BleCounters()
+    {
+        reset();
+    }
+
+    /** Count the result of a call and return it unchanged. */
+    ble_error_t check(ble_call_site_t site, ble_error_t error)
+    {
+        _counters.calls[site][ble_error_index(error)]++;
+        return error;
+    }
+
+    void count(ble_app_event_t event)
+    {
+        _counters.events[event]++;
+    }
+
+    /** Failed calls of a site, all errors together. */
+    uint32_t get_failures(ble_call_site_t site) const
+    {
+        uint32_t failures = 0;
+        for (size_t i = 1; i < BLE_ERROR_COUNTER_COUNT; i++) {
+            failures += _counters.calls[site][i];
+        }
+        return failures;
+    }
+
+    uint32_t get_count(ble_app_event_t event) const
+    {
+        return _counters.events[event];
+    }
+
+    snapshot_t snapshot() const
+    {
+        return _counters;
+    }
+
+    void reset()
+    {
+        memset(&_counters, 0, sizeof(_counters));
+    }
+
+    /**
+     * Write the non zero counters to the buffer:
+     * version (1 byte), number of entries (2 bytes, little endian), then per entry the call site
+     * (1 byte, 0xFF for events), error index or event (1 byte) and count (4 bytes, little endian).
+     *
+     * @returns Bytes written or 0 if the buffer is too small.
+     */
+    size_t serialize(uint8_t *buffer, size_t size) const
+    {
+        size_t length = 3;
+        uint16_t entries = 0;
+
+        if (size < length) {
+            return 0;
+        }
+
+        for (size_t site = 0; site < BLE_CALL_SITE_COUNT; site++) {
+            for (size_t error = 0; error < BLE_ERROR_COUNTER_COUNT; error++) {
+                if (!write_entry(buffer, size, length, entries, site, error, _counters.calls[site][error])) {
+                    return 0;
+                }
+            }
+        }
+
+        for (size_t event = 0; event < BLE_EVENT_COUNT; event++) {
+            if (!write_entry(buffer, size, length, entries, EVENT_ENTRY, event, _counters.events[event])) {
+                return 0;
+            }
+        }
+
+        buffer[0] = SERIALIZATION_VERSION;
+        buffer[1] = entries & 0xFF;
+        buffer[2] = entries >> 8;
+        return length;
+    }
+
+    /** Print the calls that failed and the event counts. */
+    void print() const
+    {
+        for (size_t site = 0; site < BLE_CALL_SITE_COUNT; site++) {
+            for (size_t error = 1; error < BLE_ERROR_COUNTER_COUNT; error++) {
+                if (_counters.calls[site][error]) {
+                    printf("Call site %u error %u: %lu failures\r\n",
+                           (unsigned)site, (unsigned)error, (unsigned long)_counters.calls[site][error]);
+                }
+            }
+        }
+        printf("Advertising started %lu, scan started %lu, connected %lu, connection failed %lu, disconnected %lu\r\n",
+               (unsigned long)_counters.events[BLE_EVENT_ADVERTISING_STARTED],
+               (unsigned long)_counters.events[BLE_EVENT_SCAN_STARTED],
+               (unsigned long)_counters.events[BLE_EVENT_CONNECTED],
+               (unsigned long)_counters.events[BLE_EVENT_CONNECTION_FAILED],
+               (unsigned long)_counters.events[BLE_EVENT_DISCONNECTED]);
+    }
+
+private:
+    static const uint8_t EVENT_ENTRY = 0xFF;
+
+    static bool write_entry(
+        uint8_t *buffer,
+        size_t size,
+        size_t &length,
+        uint16_t &entries,
+        size_t site,
+        size_t index,
+        uint32_t count
+    )
+    {
+        if (!count) {
+            return true;
+        }
+        if (length + 6 > size) {
+            return false;
+        }
+        buffer[length++] = site;
+        buffer[length++] = index;
+        buffer[length++] = count & 0xFF;
+        buffer[length++] = (count >> 8) & 0xFF;
+        buffer[length++] = (count >> 16) & 0xFF;
+        buffer[length++] = count >> 24;
+        entries++;
+        return true;
+    }
+
+private:
+    snapshot_t _counters;
+};
+
 #endif /* PRETTY_PRINTER_H_ */
@@ -0,0 +1,388 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RPA_RESOLVER_H_
+#define RPA_RESOLVER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "ble/BLE.h"
+#include "mbedtls/aes.h"
+
+/* default capacities, sized for a few dozen bonds and the devices seen around them */
+static const size_t MAX_RPA_IDENTITIES = 32;
+static const size_t MAX_RPA_CACHE_ENTRIES = 64;
+
+/** Identity of a peer using resolvable private addresses. */
+struct rpa_identity_t {
+    bool used = false;
+    /** IRK as distributed during pairing, least significant octet first. */
+    ble::irk_t irk;
+    ble::address_t address;
+    ble::peer_address_type_t address_type = ble::peer_address_type_t::PUBLIC;
+};
+
+/**
+ * Resolves the private addresses of peers to their identity, with a cache of recent results.
+ *
+ * Resolving an address means running the ah() function (AES-128) with the IRK of each known
+ * identity until one matches. Doing this for every advertising report doesn't scale, so results
+ * are cached per address, including failures, so the reports of unknown devices don't cost an
+ * AES operation each. A peer keeps its address for the RPA rotation period (15 minutes by
+ * default), entries expire after it.
+ *
+ * If privacy is enabled in the stack and the controller supports address resolution
+ * (LL_PRIVACY), reports of peers in the resolving list arrive with their identity address.
+ * These are recognised and counted without running AES. Call use_controller_resolution() to
+ * enable it: the private addresses still reported are then those the controller couldn't resolve
+ * and the host doesn't try them. The stack fills the resolving list from the bonds of the
+ * SecurityManager, so the identities added here must also be bonded peers.
+ *
+ * Use it with BLEApp::set_identity_resolver() and resolve_identity(). It needs mbedtls, link
+ * the mbed-ble-utils-rpa CMake target.
+ *
+ * MaxIdentities bounds the identities that can be added and CacheEntries the addresses whose
+ * result is remembered. With more addresses around than cache entries, the least recently seen
+ * are evicted and cost an AES operation per identity when seen again.
+ *
+ * Only use it from the event queue.
+ */
+template<size_t MaxIdentities = MAX_RPA_IDENTITIES, size_t CacheEntries = MAX_RPA_CACHE_ENTRIES>
+class RpaResolver
+{
+    static_assert(MaxIdentities > 0 && MaxIdentities < 0x7FFF, "identities are indexed by an int16_t");
+    static_assert(CacheEntries > 0, "the cache needs at least one entry");
+
+public:
+    enum result_t {
+        /** The address isn't a resolvable private address. */
+        NOT_RESOLVABLE,
+        /** Resolved to a known identity. */
+        RESOLVED,
+        /** Resolvable, but with none of the known IRKs. */
+        UNRESOLVED
+    };
+
+    struct stats_t {
+        uint32_t lookups = 0;
+        uint32_t cache_hits = 0;
+        /** Addresses the controller resolved for us. */
+        uint32_t controller_resolved = 0;
+        uint32_t aes_operations = 0;
+    };
+
+    /** True if the controller can resolve addresses itself. */
+    static bool controller_can_resolve(ble::Gap &gap)
+    {
+        return gap.isFeatureSupported(ble::controller_supported_features_t::LL_PRIVACY);
+    }
+
+    /**
+     * Let the controller resolve addresses if it can. Privacy is enabled in Gap, call it once
+     * the SecurityManager is initialized with its bond database.
+     *
+     * @returns True if the controller resolves addresses from now on, false if it can't and
+     * they are resolved on the host.
+     */
+    bool use_controller_resolution(ble::Gap &gap)
+    {
+#if BLE_FEATURE_PRIVACY
+        if (!controller_can_resolve(gap)) {
+            return false;
+        }
+
+        ble::central_privacy_configuration_t configuration;
+        configuration.use_non_resolvable_random_address = false;
+        configuration.resolution_strategy = ble::central_privacy_configuration_t::RESOLVE_AND_FORWARD;
+
+        if (gap.setCentralPrivacyConfiguration(&configuration) || gap.enablePrivacy(true)) {
+            return false;
+        }
+
+        _controller_resolves = true;
+        /* unresolved entries were computed on the host */
+        flush(-1);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /** How long a peer keeps its private address, entries expire after it. */
+    void set_rotation_period(ble::millisecond_t period)
+    {
+        _rotation_period_ms = period.value();
+    }
+
+    /** Add an identity to resolve addresses to, e.g. one loaded from the bonds of the app. */
+    bool add_identity(
+        const ble::irk_t &irk,
+        const ble::address_t &address,
+        ble::peer_address_type_t address_type
+    )
+    {
+        for (size_t i = 0; i < MaxIdentities; i++) {
+            if (!_identities[i].used) {
+                _identities[i].used = true;
+                _identities[i].irk = irk;
+                _identities[i].address = address;
+                _identities[i].address_type = address_type;
+                /* addresses that didn't resolve before may belong to it */
+                flush(-1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /** Forget the identity with this address and the addresses resolved to it. */
+    void remove_identity(const ble::address_t &address)
+    {
+        for (size_t i = 0; i < MaxIdentities; i++) {
+            if (_identities[i].used && _identities[i].address == address) {
+                _identities[i].used = false;
+                flush(i);
+            }
+        }
+    }
+
+    size_t get_identity_count() const
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < MaxIdentities; i++) {
+            if (_identities[i].used) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Resolve the address of a peer.
+     *
+     * @param[out] identity Set to the identity of the peer if the result is RESOLVED.
+     */
+    result_t resolve(
+        ble::peer_address_type_t address_type,
+        const ble::address_t &address,
+        uint32_t now,
+        const rpa_identity_t **identity
+    )
+    {
+        if (address_type == ble::peer_address_type_t::PUBLIC_IDENTITY ||
+            address_type == ble::peer_address_type_t::RANDOM_STATIC_IDENTITY) {
+            _stats.lookups++;
+            _stats.controller_resolved++;
+            *identity = find_identity(address);
+            return *identity ? RESOLVED : NOT_RESOLVABLE;
+        }
+
+        /* the two most significant bits of a resolvable private address are 0b01 */
+        if (address_type != ble::peer_address_type_t::RANDOM || (address[5] >> 6) != 0x01) {
+            return NOT_RESOLVABLE;
+        }
+
+        _stats.lookups++;
+
+        if (_controller_resolves) {
+            /* the controller forwards the peers it resolved with their identity address */
+            return UNRESOLVED;
+        }
+
+        cache_entry_t *entry = find_entry(address, now);
+        if (entry) {
+            _stats.cache_hits++;
+            entry->last_seen = now;
+        } else {
+            entry = allocate_entry(now);
+            entry->used = true;
+            entry->address = address;
+            entry->expiry = now + _rotation_period_ms;
+            entry->last_seen = now;
+            entry->identity = resolve_with_irks(address);
+        }
+
+        if (entry->identity < 0) {
+            return UNRESOLVED;
+        }
+
+        *identity = &_identities[entry->identity];
+        return RESOLVED;
+    }
+
+    /**
+     * Identity address of the peer if its address resolves to a known identity, with the
+     * signature of BLEApp::identity_resolver_t.
+     */
+    bool resolve_identity(
+        ble::peer_address_type_t address_type,
+        const ble::address_t &address,
+        uint32_t now,
+        ble::address_t &identity_address
+    )
+    {
+        const rpa_identity_t *identity = nullptr;
+
+        if (!get_identity_count() || resolve(address_type, address, now, &identity) != RESOLVED) {
+            return false;
+        }
+
+        identity_address = identity->address;
+        return true;
+    }
+
+    stats_t get_stats() const
+    {
+        return _stats;
+    }
+
+    void print_stats() const
+    {
+        uint32_t hit_permille = _stats.lookups ?
+            (uint32_t)((uint64_t)(_stats.cache_hits + _stats.controller_resolved) * 1000 / _stats.lookups) : 0;
+        printf("RPA lookups %lu, cache hits %lu, controller resolved %lu, AES %lu, hit rate %lu.%lu%%\r\n",
+               (unsigned long)_stats.lookups, (unsigned long)_stats.cache_hits,
+               (unsigned long)_stats.controller_resolved, (unsigned long)_stats.aes_operations,
+               (unsigned long)(hit_permille / 10), (unsigned long)(hit_permille % 10));
+    }
+
+    void reset_stats()
+    {
+        _stats = stats_t();
+    }
+
+private:
+    struct cache_entry_t {
+        bool used = false;
+        ble::address_t address;
+        /* index of the identity, -1 if the address didn't resolve */
+        int16_t identity = -1;
+        uint32_t expiry = 0;
+        uint32_t last_seen = 0;
+    };
+
+    const rpa_identity_t* find_identity(const ble::address_t &address) const
+    {
+        for (size_t i = 0; i < MaxIdentities; i++) {
+            if (_identities[i].used && _identities[i].address == address) {
+                return &_identities[i];
+            }
+        }
+        return nullptr;
+    }
+
+    cache_entry_t* find_entry(const ble::address_t &address, uint32_t now)
+    {
+        for (size_t i = 0; i < CacheEntries; i++) {
+            cache_entry_t &entry = _cache[i];
+            if (!entry.used) {
+                continue;
+            }
+            if ((int32_t)(now - entry.expiry) >= 0) {
+                entry.used = false;
+                continue;
+            }
+            if (entry.address == address) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    /** Free entry or the least recently seen one. */
+    cache_entry_t* allocate_entry(uint32_t now)
+    {
+        cache_entry_t *oldest = &_cache[0];
+        for (size_t i = 0; i < CacheEntries; i++) {
+            if (!_cache[i].used) {
+                return &_cache[i];
+            }
+            if ((int32_t)(_cache[i].last_seen - oldest->last_seen) < 0) {
+                oldest = &_cache[i];
+            }
+        }
+        return oldest;
+    }
+
+    /** Drop the cache entries pointing to the identity, -1 for unresolved entries. */
+    void flush(int16_t identity)
+    {
+        for (size_t i = 0; i < CacheEntries; i++) {
+            if (_cache[i].identity == identity) {
+                _cache[i].used = false;
+            }
+        }
+    }
+
+    /** Index of the identity whose IRK resolves the address or -1. */
+    int16_t resolve_with_irks(const ble::address_t &address)
+    {
+        for (size_t i = 0; i < MaxIdentities; i++) {
+            if (_identities[i].used && matches(_identities[i].irk, address)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Random address hash function ah(k, r) = e(k, padding || r) mod 2^24 compared to the hash
+     * part of the address. The address is stored least significant octet first: hash in
+     * octets 0 to 2 and prand in octets 3 to 5. e() takes its key and data most significant
+     * octet first.
+     */
+    bool matches(const ble::irk_t &irk, const ble::address_t &address)
+    {
+        uint8_t key[16];
+        uint8_t block[16] = { 0 };
+        uint8_t encrypted[16];
+
+        for (size_t i = 0; i < 16; i++) {
+            key[i] = irk[15 - i];
+        }
+        block[13] = address[5];
+        block[14] = address[4];
+        block[15] = address[3];
+
+        mbedtls_aes_context aes;
+        mbedtls_aes_init(&aes);
+        int ret = mbedtls_aes_setkey_enc(&aes, key, 128);
+        if (!ret) {
+            ret = mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, block, encrypted);
+        }
+        mbedtls_aes_free(&aes);
+        _stats.aes_operations++;
+
+        if (ret) {
+            return false;
+        }
+
+        return encrypted[15] == address[0] &&
+               encrypted[14] == address[1] &&
+               encrypted[13] == address[2];
+    }
+
+private:
+    rpa_identity_t _identities[MaxIdentities];
+    cache_entry_t _cache[CacheEntries];
+    uint32_t _rotation_period_ms = 15 * 60 * 1000;
+    bool _controller_resolves = false;
+    stats_t _stats;
+};
+
+#endif /* RPA_RESOLVER_H_ */
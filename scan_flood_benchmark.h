@@ -0,0 +1,353 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCAN_FLOOD_BENCHMARK_H_
+#define SCAN_FLOOD_BENCHMARK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "ble_app.h"
+
+static const size_t MAX_FLOOD_PAYLOADS = 8;
+static const size_t MAX_FLOOD_STEPS = 16;
+
+/**
+ * Floods a BLEApp with synthetic advertising reports to find the report rate its event queue
+ * can sustain.
+ *
+ * Reports are posted to the app's event queue one event per report, the way the stack hands
+ * them over, and delivered to BLEApp::onAdvertisingReport(). Each step of a run injects reports
+ * at a fixed rate for a fixed time. Payloads are drawn from a weighted mix, and a configurable
+ * share of reports carries the app's target name so they match.
+ *
+ * For each step the benchmark reports the reports injected, the injections that failed because
+ * the queue ran out of event memory, the queue high water mark (synthetic reports plus the app's
+ * own events) and the latency from injecting a matching report to the app finishing its
+ * handling. While running, the app's connect call is replaced by a hook that doesn't reach the
+ * controller: the scan keeps running and nothing is printed per match. After each match a failed
+ * ConnectionCompleteEvent is fed to the app, which cancels the connection timeout of the attempt,
+ * so the queue only holds the reports and the app's own events.
+ *
+ * Runs are reproducible, the random generator is reseeded by start().
+ */
+class ScanFloodBenchmark : private mbed::NonCopyable<ScanFloodBenchmark>
+{
+public:
+    /** Results of a step. Times are in milliseconds. */
+    struct step_result_t {
+        uint32_t rate = 0;
+        uint32_t injected = 0;
+        uint32_t failed_posts = 0;
+        uint32_t processed = 0;
+        uint32_t queue_high_water = 0;
+        uint32_t app_failed_posts = 0;
+        uint32_t matches = 0;
+        uint32_t avg_match_latency_ms = 0;
+        uint32_t max_match_latency_ms = 0;
+    };
+
+    explicit ScanFloodBenchmark(BLEApp &app) : _app(app), _queue(app.get_event_queue())
+    {
+    }
+
+    /**
+     * Add a payload to the mix of non matching reports. The data must outlive the benchmark.
+     *
+     * @param weight Relative frequency of the payload in the mix.
+     */
+    bool add_payload(mbed::Span<const uint8_t> payload, uint8_t weight = 1)
+    {
+        if (_payload_count == MAX_FLOOD_PAYLOADS || !weight) {
+            return false;
+        }
+        _payloads[_payload_count] = payload;
+        _weights[_payload_count] = weight;
+        _total_weight += weight;
+        _payload_count++;
+        return true;
+    }
+
+    /** Share of reports carrying the target name, in permille. */
+    void set_match_ratio(uint16_t permille)
+    {
+        _match_permille = permille > 1000 ? 1000 : permille;
+    }
+
+    /**
+     * Start a run from the event queue of the app, one step per rate.
+     *
+     * @param rates Report rates in reports per second, e.g. 1000 to 50000.
+     * @param count Number of rates, at most MAX_FLOOD_STEPS.
+     * @param step_duration How long each rate is held.
+     * @param done Called with the results when the run ends.
+     */
+    bool start(
+        const uint32_t *rates,
+        size_t count,
+        ble::millisecond_t step_duration,
+        mbed::Callback<void(const step_result_t *results, size_t count)> done = nullptr
+    )
+    {
+        if (_running || !count || count > MAX_FLOOD_STEPS || !_app.get_target_name()) {
+            return false;
+        }
+
+        /* the matching payload carries the target name */
+        ble::AdvertisingDataBuilder builder(_match_buffer);
+        builder.setFlags();
+        if (builder.setName(_app.get_target_name())) {
+            return false;
+        }
+        _match_payload = builder.getAdvertisingData();
+
+        for (size_t i = 0; i < count; i++) {
+            _results[i] = step_result_t();
+            _results[i].rate = rates[i];
+        }
+        _step_count = count;
+        _step = 0;
+        _step_duration_ms = step_duration.value();
+        _done = done;
+        _running = true;
+        _random = RANDOM_SEED;
+
+        /* matches must not create connections on the controller */
+        _app.set_connect_hook([](
+            ble::peer_address_type_t, const ble::address_t &, const ble::ConnectionParameters &
+        ) {
+            return BLE_ERROR_NONE;
+        });
+
+        start_step();
+        return true;
+    }
+
+    /** Print the results of the last run. */
+    void print_results() const
+    {
+        printf("rate/s injected failed processed hwm app_failed matches lat_avg_ms lat_max_ms\r\n");
+        for (size_t i = 0; i < _step_count; i++) {
+            const step_result_t &r = _results[i];
+            printf("%lu %lu %lu %lu %lu %lu %lu %lu %lu\r\n",
+                   (unsigned long)r.rate, (unsigned long)r.injected, (unsigned long)r.failed_posts,
+                   (unsigned long)r.processed, (unsigned long)r.queue_high_water,
+                   (unsigned long)r.app_failed_posts, (unsigned long)r.matches,
+                   (unsigned long)r.avg_match_latency_ms, (unsigned long)r.max_match_latency_ms);
+        }
+    }
+
+private:
+    void start_step()
+    {
+        _app.reset_event_queue_stats();
+        _pending = 0;
+        _rate_remainder = 0;
+        _step_start = _queue.tick();
+        _last_tick = _step_start;
+        _latency_sum = 0;
+        _ticker_id = _queue.call_every(std::chrono::milliseconds(1), [this]() { inject(); });
+    }
+
+    void end_step()
+    {
+        _queue.cancel(_ticker_id);
+
+        step_result_t &result = _results[_step];
+        BLEApp::event_queue_stats_t app_stats = _app.get_event_queue_stats();
+        result.app_failed_posts = app_stats.failed_posts;
+        if (result.matches) {
+            result.avg_match_latency_ms = _latency_sum / result.matches;
+        }
+
+        _step++;
+        if (_step < _step_count) {
+            /* let the queue drain before the next step */
+            _queue.call_in(std::chrono::milliseconds(100), [this]() { start_step(); });
+        } else {
+            _running = false;
+            _app.set_connect_hook(nullptr);
+            if (_done) {
+                _done(_results, _step_count);
+            }
+        }
+    }
+
+    /** Inject the reports due since the last tick. */
+    void inject()
+    {
+        const uint32_t now = _queue.tick();
+        step_result_t &result = _results[_step];
+
+        if (now - _step_start >= _step_duration_ms) {
+            end_step();
+            return;
+        }
+
+        /* reports per millisecond, carrying the remainder over */
+        uint32_t due = result.rate * (now - _last_tick) + _rate_remainder;
+        _rate_remainder = due % 1000;
+        due /= 1000;
+        _last_tick = now;
+
+        for (uint32_t i = 0; i < due; i++) {
+            post_report(result, now);
+        }
+    }
+
+    void post_report(step_result_t &result, uint32_t now)
+    {
+        const uint32_t sequence = result.injected++;
+        const bool match = (next_random() % 1000) < _match_permille;
+        const size_t payload = match ? 0 : pick_payload();
+
+        _pending++;
+        int id = _queue.call([this, sequence, match, payload, now]() {
+            deliver(sequence, match, payload, now);
+        });
+
+        if (!id) {
+            _pending--;
+            result.failed_posts++;
+            return;
+        }
+
+        uint32_t depth = _pending + _app.get_event_queue_stats().depth;
+        if (depth > result.queue_high_water) {
+            result.queue_high_water = depth;
+        }
+    }
+
+    void deliver(uint32_t sequence, bool match, size_t payload, uint32_t injected_at)
+    {
+        _pending--;
+
+        if (!_running) {
+            return;
+        }
+
+        step_result_t &result = _results[_step];
+        result.processed++;
+
+        /* one address per report so the app can't rely on address caching */
+        const uint8_t address_bytes[6] = {
+            (uint8_t)sequence, (uint8_t)(sequence >> 8), (uint8_t)(sequence >> 16),
+            (uint8_t)(sequence >> 24), 0x00, 0xC0
+        };
+        const ble::address_t address(address_bytes);
+
+        ble::AdvertisingReportEvent event(
+            /* legacy connectable scannable undirected */
+            ble::advertising_event_t(0x13),
+            ble::peer_address_type_t::RANDOM,
+            address,
+            ble::phy_t::LE_1M,
+            ble::phy_t::NONE,
+            ble::advertising_sid_t(0xFF),
+            ble::advertising_power_t(127),
+            ble::rssi_t(-60),
+            0,
+            ble::peer_address_type_t::ANONYMOUS,
+            ble::address_t(),
+            match ? _match_payload : (_payload_count ? _payloads[payload] : mbed::Span<const uint8_t>())
+        );
+
+        static_cast<ble::Gap::EventHandler&>(_app).onAdvertisingReport(event);
+
+        if (!match) {
+            return;
+        }
+
+        uint32_t latency = _queue.tick() - injected_at;
+        result.matches++;
+        _latency_sum += latency;
+        if (latency > result.max_match_latency_ms) {
+            result.max_match_latency_ms = latency;
+        }
+
+        /* pretend the connection failed so the app resumes scanning */
+        ble::ConnectionCompleteEvent failed(
+            BLE_ERROR_UNSPECIFIED,
+            0,
+            ble::connection_role_t::CENTRAL,
+            ble::peer_address_type_t::RANDOM,
+            address,
+            ble::address_t(),
+            ble::address_t(),
+            ble::conn_interval_t(6),
+            0,
+            ble::supervision_timeout_t(10),
+            0
+        );
+        static_cast<ble::Gap::EventHandler&>(_app).onConnectionComplete(failed);
+    }
+
+    size_t pick_payload()
+    {
+        if (!_payload_count) {
+            return 0;
+        }
+
+        uint32_t pick = next_random() % _total_weight;
+        for (size_t i = 0; i < _payload_count; i++) {
+            if (pick < _weights[i]) {
+                return i;
+            }
+            pick -= _weights[i];
+        }
+        return 0;
+    }
+
+    /** xorshift32, runs are reproducible */
+    uint32_t next_random()
+    {
+        _random ^= _random << 13;
+        _random ^= _random >> 17;
+        _random ^= _random << 5;
+        return _random;
+    }
+
+private:
+    BLEApp &_app;
+    events::EventQueue &_queue;
+
+    mbed::Span<const uint8_t> _payloads[MAX_FLOOD_PAYLOADS];
+    uint8_t _weights[MAX_FLOOD_PAYLOADS];
+    size_t _payload_count = 0;
+    uint32_t _total_weight = 0;
+    uint16_t _match_permille = 10;
+
+    uint8_t _match_buffer[ble::LEGACY_ADVERTISING_MAX_SIZE];
+    mbed::Span<const uint8_t> _match_payload;
+
+    step_result_t _results[MAX_FLOOD_STEPS];
+    mbed::Callback<void(const step_result_t *results, size_t count)> _done;
+    size_t _step_count = 0;
+    size_t _step = 0;
+    uint32_t _step_duration_ms = 0;
+    bool _running = false;
+
+    int _ticker_id = 0;
+    uint32_t _step_start = 0;
+    uint32_t _last_tick = 0;
+    uint32_t _rate_remainder = 0;
+    uint32_t _pending = 0;
+    uint64_t _latency_sum = 0;
+    static const uint32_t RANDOM_SEED = 0x12345678;
+    uint32_t _random = RANDOM_SEED;
+};
+
+#endif /* SCAN_FLOOD_BENCHMARK_H_ */
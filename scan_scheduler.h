@@ -0,0 +1,259 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2006-2019 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCAN_SCHEDULER_H_
+#define SCAN_SCHEDULER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "ble/BLE.h"
+
+/**
+ * Parameters of a single scan period.
+ */
+struct ScanProfile {
+    /** Time between the start of two consecutive scan windows. */
+    ble::scan_interval_t interval;
+    /** Time the radio listens in each interval. */
+    ble::scan_window_t window;
+    /** How long the scan runs before it times out. */
+    ble::scan_duration_t duration;
+    /** Pause between the scan timing out and the next scan starting. */
+    ble::millisecond_t idle_period;
+    /** Send scan requests to get scan responses. */
+    bool active;
+    /** Also scan on the coded PHY (if the controller supports it). */
+    bool coded_phy;
+};
+
+/**
+ * Picks scan parameters for the next scan. Scanning starts with the first (most aggressive)
+ * profile while a target is expected and moves to the next profile every time a scan times
+ * out without finding the target. Finding the target or calling expect_target() goes back
+ * to the first profile.
+ *
+ * Use hold() when scanning isn't looking for a target, e.g. to collect every report: the
+ * level stays where it was put instead of backing off on timeouts until release().
+ *
+ * It also keeps track of the time the radio actually spent listening so the achieved duty
+ * cycle can be reported. All timestamps are in milliseconds (e.g. EventQueue::tick()).
+ */
+class ScanScheduler
+{
+public:
+    static const size_t MAX_PROFILES = 4;
+
+    ScanScheduler()
+    {
+        static const ScanProfile default_profiles[] = {
+            /* 100% duty cycle while we expect the target */
+            { ble::scan_interval_t(80), ble::scan_window_t(80),
+              ble::scan_duration_t(ble::second_t(10)), ble::millisecond_t(0), false, false },
+            /* 50% duty cycle */
+            { ble::scan_interval_t(80), ble::scan_window_t(40),
+              ble::scan_duration_t(ble::second_t(10)), ble::millisecond_t(0), false, false },
+            /* ~1% duty cycle with a pause */
+            { ble::scan_interval_t(2048), ble::scan_window_t(18),
+              ble::scan_duration_t(ble::second_t(10)), ble::millisecond_t(20000), false, false },
+            /* ~0.5% duty cycle with a long pause */
+            { ble::scan_interval_t(4096), ble::scan_window_t(18),
+              ble::scan_duration_t(ble::second_t(5)), ble::millisecond_t(60000), false, false },
+        };
+
+        set_profiles(default_profiles, sizeof(default_profiles) / sizeof(default_profiles[0]));
+    }
+
+    /**
+     * Replace the profiles, ordered from most to least aggressive.
+     *
+     * @returns False if count is 0 or larger than MAX_PROFILES.
+     */
+    bool set_profiles(const ScanProfile *profiles, size_t count)
+    {
+        if (!profiles || !count || count > MAX_PROFILES) {
+            return false;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            _profiles[i] = profiles[i];
+        }
+        _profile_count = count;
+        _level = _held ? clamp_level(_hold_level) : 0;
+
+        return true;
+    }
+
+    /** Profile to use for the next scan. */
+    const ScanProfile& current_profile() const
+    {
+        return _profiles[_level];
+    }
+
+    /** Index of the current profile, 0 being the most aggressive. */
+    size_t current_level() const
+    {
+        return _level;
+    }
+
+    /** Go back to the most aggressive profile, we expect the target to show up. */
+    void expect_target()
+    {
+        if (!_held) {
+            _level = 0;
+        }
+    }
+
+    /**
+     * Scan with the profile at this level, clamped to the last profile, until release(). Scan
+     * timeouts don't back off and expect_target() doesn't change it.
+     */
+    void hold(size_t level)
+    {
+        _held = true;
+        _hold_level = level;
+        _level = clamp_level(level);
+    }
+
+    /** Back off from the current level again on timeouts. */
+    void release()
+    {
+        _held = false;
+    }
+
+    bool is_held() const
+    {
+        return _held;
+    }
+
+    /** Apply the current profile to scan parameters. */
+    void configure(ble::ScanParameters &params, bool coded_phy_supported) const
+    {
+        const ScanProfile &profile = current_profile();
+        const bool coded = profile.coded_phy && coded_phy_supported;
+
+        params.set1mPhyConfiguration(profile.interval, profile.window, profile.active);
+        if (coded) {
+            params.setCodedPhyConfiguration(profile.interval, profile.window, profile.active);
+        }
+        params.setPhys(true, coded);
+    }
+
+    /** Call when the scan has been started with the current profile. */
+    void on_scan_started(uint32_t now_ms, bool coded_phy_used)
+    {
+        if (!_epoch_set) {
+            _epoch_ms = now_ms;
+            _epoch_set = true;
+        }
+        _scan_start_ms = now_ms;
+        /* the level may change before the scan stops, remember the duty of this scan */
+        _scan_permille = profile_duty_cycle_permille(current_profile(), coded_phy_used);
+        _scanning = true;
+        _target_found = false;
+    }
+
+    /** Call when the target has been found. The next scan will use the most aggressive profile. */
+    void on_target_found()
+    {
+        _target_found = true;
+        if (!_held) {
+            _level = 0;
+        }
+    }
+
+    /**
+     * Call when the scan has been stopped or has timed out.
+     *
+     * @returns Time to wait in milliseconds before starting the next scan.
+     */
+    uint32_t on_scan_stopped(uint32_t now_ms)
+    {
+        if (!_scanning) {
+            return 0;
+        }
+        _scanning = false;
+
+        _radio_on_ms += (uint64_t)(now_ms - _scan_start_ms) * _scan_permille / 1000;
+
+        uint32_t idle_ms = current_profile().idle_period.value();
+
+        if (!_held && !_target_found && (_level + 1 < _profile_count)) {
+            /* nothing found, back off */
+            _level++;
+        }
+
+        return idle_ms;
+    }
+
+    /** Configured duty cycle of a profile in permille. */
+    static uint32_t profile_duty_cycle_permille(const ScanProfile &profile, bool coded_phy_used)
+    {
+        if (!profile.interval.value()) {
+            return 0;
+        }
+        uint32_t windows = profile.window.value() * (coded_phy_used ? 2 : 1);
+        uint32_t permille = windows * 1000 / profile.interval.value();
+        return permille > 1000 ? 1000 : permille;
+    }
+
+    /** Duty cycle in permille achieved since the first scan, including idle periods. */
+    uint32_t achieved_duty_cycle_permille(uint32_t now_ms) const
+    {
+        uint64_t radio_on_ms = _radio_on_ms;
+        if (_scanning) {
+            radio_on_ms += (uint64_t)(now_ms - _scan_start_ms) * _scan_permille / 1000;
+        }
+
+        uint32_t elapsed_ms = now_ms - _epoch_ms;
+        if (!_epoch_set || !elapsed_ms) {
+            return 0;
+        }
+
+        return (uint32_t)(radio_on_ms * 1000 / elapsed_ms);
+    }
+
+    /** Print the current profile and the achieved duty cycle. */
+    void print_stats(uint32_t now_ms) const
+    {
+        uint32_t duty = achieved_duty_cycle_permille(now_ms);
+        printf("Scan profile %u, achieved duty cycle %lu.%lu%%\r\n",
+               (unsigned)_level, (unsigned long)(duty / 10), (unsigned long)(duty % 10));
+    }
+
+private:
+    size_t clamp_level(size_t level) const
+    {
+        return level < _profile_count ? level : _profile_count - 1;
+    }
+
+private:
+    ScanProfile _profiles[MAX_PROFILES];
+    size_t _profile_count = 0;
+    size_t _level = 0;
+    size_t _hold_level = 0;
+    bool _held = false;
+
+    uint32_t _epoch_ms = 0;
+    uint32_t _scan_start_ms = 0;
+    uint64_t _radio_on_ms = 0;
+    bool _epoch_set = false;
+    bool _scanning = false;
+    uint32_t _scan_permille = 0;
+    bool _target_found = false;
+};
+
+#endif /* SCAN_SCHEDULER_H_ */